@@ -0,0 +1,801 @@
+/*
+unix_benchmark.cpp
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+
+A headless benchmark of the main Framework operations, driven by the Santa Cruz
+sample map, the standard style sheet and the DejaVu fonts. The results
+(latency percentiles, throughput and peak resident memory) are written as JSON
+so that successive SDK drops can be compared automatically.
+
+Usage: unix_benchmark [--map FILE] [--style FILE] [--font FILE] [--iterations N] [--output FILE] [--trace FILE]
+
+If --trace is given, each operation is recorded as a profiler frame and the
+events are written to FILE in Chrome trace-event format; the per-stage totals
+are also added to the JSON report.
+*/
+
+#include <cartotype.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+namespace
+{
+
+/** Benchmark settings; the defaults use the data shipped with the SDK. */
+class BenchmarkParam
+    {
+    public:
+    std::string MapFileName = "../../../../src/test/data/ctm1/santa-cruz.ctm1";
+    std::string StyleSheetFileName = "../../../../style/standard.ctstyle";
+    std::string FontFileName = "../../../../font/DejaVuSans.ttf";
+    std::string OutputFileName;
+    std::string TraceFileName;
+    int32_t ViewWidth = 1024;
+    int32_t ViewHeight = 1024;
+    int32_t TileSize = 256;
+    int32_t Iterations = 10;
+    };
+
+/** Returns a string quoted and escaped for use in JSON. */
+std::string JsonString(const std::string& aText)
+    {
+    std::string s = "\"";
+    for (char c : aText)
+        {
+        switch (c)
+            {
+            case '"': s += "\\\""; break;
+            case '\\': s += "\\\\"; break;
+            case '\n': s += "\\n"; break;
+            case '\r': s += "\\r"; break;
+            case '\t': s += "\\t"; break;
+            default:
+                if (uint8_t(c) < 0x20)
+                    {
+                    char buffer[8];
+                    snprintf(buffer,sizeof(buffer),"\\u%04x",c);
+                    s += buffer;
+                    }
+                else
+                    s += c;
+                break;
+            }
+        }
+    s += '"';
+    return s;
+    }
+
+/** Latency samples for a single named operation. */
+class Measurement
+    {
+    public:
+    explicit Measurement(const std::string& aName): m_name(aName) { }
+
+    /** Adds a latency sample in seconds. */
+    void Add(double aSeconds) { m_samples.push_back(aSeconds); }
+    /** Records a failed operation. */
+    void AddError(CartoType::Result aError) { m_errors++; m_last_error = aError; }
+    /** Adds an arbitrary integer property to be reported with the timings. */
+    void SetProperty(const std::string& aName,int64_t aValue) { m_properties.emplace_back(aName,aValue); }
+
+    void WriteAsJson(std::ostream& aOutput) const;
+
+    private:
+    double Percentile(double aFraction) const;
+
+    std::string m_name;
+    std::vector<double> m_samples;
+    std::vector<std::pair<std::string,int64_t>> m_properties;
+    int32_t m_errors = 0;
+    CartoType::Result m_last_error;
+    };
+
+double Measurement::Percentile(double aFraction) const
+    {
+    if (m_samples.empty())
+        return 0;
+    std::vector<double> sorted = m_samples;
+    std::sort(sorted.begin(),sorted.end());
+    size_t index = (size_t)std::ceil(aFraction * sorted.size());
+    if (index > 0)
+        index--;
+    return sorted[std::min(index,sorted.size() - 1)];
+    }
+
+void Measurement::WriteAsJson(std::ostream& aOutput) const
+    {
+    double total = 0;
+    for (double s : m_samples)
+        total += s;
+    aOutput << "    {\n";
+    aOutput << "      \"name\": " << JsonString(m_name) << ",\n";
+    aOutput << "      \"count\": " << m_samples.size() << ",\n";
+    aOutput << "      \"errors\": " << m_errors << ",\n";
+    if (m_errors)
+        aOutput << "      \"last_error\": " << (uint32_t)m_last_error << ",\n";
+    for (const auto& p : m_properties)
+        aOutput << "      " << JsonString(p.first) << ": " << p.second << ",\n";
+    aOutput << "      \"p50_ms\": " << Percentile(0.5) * 1000 << ",\n";
+    aOutput << "      \"p99_ms\": " << Percentile(0.99) * 1000 << ",\n";
+    aOutput << "      \"mean_ms\": " << (m_samples.empty() ? 0 : total / m_samples.size() * 1000) << ",\n";
+    aOutput << "      \"throughput_per_s\": " << (total > 0 ? m_samples.size() / total : 0) << "\n";
+    aOutput << "    }";
+    }
+
+/** A simple stopwatch returning elapsed time in seconds. */
+class Stopwatch
+    {
+    public:
+    Stopwatch(): m_start(std::chrono::steady_clock::now()) { }
+    double Seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count(); }
+
+    private:
+    std::chrono::steady_clock::time_point m_start;
+    };
+
+/** Returns the peak resident set size of this process in kilobytes. */
+int64_t PeakRssInKilobytes()
+    {
+    rusage usage = { };
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+    }
+
+/** Returns the point at the fractions aFx and aFy of the way across a rectangle. */
+CartoType::PointFP PointInExtent(const CartoType::RectFP& aExtent,double aFx,double aFy)
+    {
+    return CartoType::PointFP(aExtent.Min.X + (aExtent.Max.X - aExtent.Min.X) * aFx,aExtent.Min.Y + (aExtent.Max.Y - aExtent.Min.Y) * aFy);
+    }
+
+/** Converts a longitude to a slippy-map tile column at a given zoom level. */
+int32_t TileX(double aLong,int32_t aZoom)
+    {
+    return (int32_t)std::floor((aLong + 180.0) / 360.0 * (1 << aZoom));
+    }
+
+/** Converts a latitude to a slippy-map tile row at a given zoom level. */
+int32_t TileY(double aLat,int32_t aZoom)
+    {
+    double lat = aLat * CartoType::KDegreesToRadiansDouble;
+    return (int32_t)std::floor((1.0 - std::log(std::tan(lat) + 1.0 / std::cos(lat)) / CartoType::KPiDouble) / 2.0 * (1 << aZoom));
+    }
+
+/** The fixed origin-destination pairs used for routing, as fractions of the map extent. */
+const double TheRouteEnds[][4] =
+    {
+    { 0.30, 0.40, 0.70, 0.60 },
+    { 0.45, 0.30, 0.55, 0.75 },
+    { 0.25, 0.65, 0.60, 0.35 },
+    { 0.50, 0.50, 0.80, 0.45 }
+    };
+
+class Benchmark
+    {
+    public:
+    explicit Benchmark(const BenchmarkParam& aParam): m_param(aParam) { }
+    CartoType::Result Run();
+    void WriteAsJson(std::ostream& aOutput) const;
+
+    private:
+    std::unique_ptr<CartoType::Framework> CreateFramework(CartoType::Result& aError) const;
+    CartoType::Framework::Param FrameworkParam() const;
+    void MeasureStartup(const char* aName,const CartoType::Framework::Param& aParam);
+    void MeasureStartup();
+    void MeasureMapBitmap();
+    void MeasureTileBitmap();
+    void MeasureFind();
+    void MeasureRouting();
+    void MeasureMatrix();
+    void MeasureNavigation();
+    void MeasureElevation();
+    void MeasureTerrain();
+    CartoType::RouteCoordSet RouteEnds(size_t aIndex) const;
+    void WriteProfileAsJson(std::ostream& aOutput) const;
+
+    BenchmarkParam m_param;
+    CartoType::Profiler m_profiler;
+    std::unique_ptr<CartoType::Framework> m_framework;
+    CartoType::RectFP m_extent;
+    std::vector<Measurement> m_measurements;
+    };
+
+std::unique_ptr<CartoType::Framework> Benchmark::CreateFramework(CartoType::Result& aError) const
+    {
+    return CartoType::Framework::New(aError,FrameworkParam());
+    }
+
+CartoType::Framework::Param Benchmark::FrameworkParam() const
+    {
+    CartoType::Framework::Param param;
+    param.MapFileName = m_param.MapFileName.c_str();
+    param.StyleSheetFileName = m_param.StyleSheetFileName.c_str();
+    param.FontFileName = m_param.FontFileName.c_str();
+    param.ViewWidth = m_param.ViewWidth;
+    param.ViewHeight = m_param.ViewHeight;
+    return param;
+    }
+
+CartoType::Result Benchmark::Run()
+    {
+    if (!m_param.TraceFileName.empty())
+        {
+        m_profiler.Enable(true);
+        m_profiler.EnableTrace(true);
+        CartoType::Profiler::SetCurrent(&m_profiler);
+        }
+
+    CartoType::Result error;
+    m_framework = CreateFramework(error);
+    if (error)
+        return error;
+    error = m_framework->GetMapExtent(m_extent,CartoType::CoordType::Degree);
+    if (error)
+        return error;
+
+    MeasureStartup();
+    MeasureMapBitmap();
+    MeasureTileBitmap();
+    MeasureFind();
+    MeasureRouting();
+    MeasureMatrix();
+    MeasureNavigation();
+    MeasureElevation();
+    MeasureTerrain();
+    CartoType::Profiler::SetCurrent(nullptr);
+
+    if (!m_param.TraceFileName.empty())
+        {
+        error = CartoType::KErrorNone;
+        auto trace = CartoType::FileOutputStream::New(error,m_param.TraceFileName);
+        if (error)
+            return error;
+        m_profiler.WriteChromeTrace(*trace);
+        }
+    return CartoType::KErrorNone;
+    }
+
+/**
+Measures startup in three configurations: the default, which loads the text index;
+a tile worker, which does not need the text index; and a framework created from an
+engine and map data set that have already been loaded, as when a process creates
+several frameworks sharing the same data.
+*/
+void Benchmark::MeasureStartup()
+    {
+    CartoType::Framework::Param param = FrameworkParam();
+    MeasureStartup("framework_new",param);
+
+    param.TextIndexLevels = -1;
+    MeasureStartup("framework_new_no_text_index",param);
+
+    CartoType::Result error;
+    param = FrameworkParam();
+    param.SharedEngine = CartoType::FrameworkEngine::New(error,param.FontFileName);
+    if (!error)
+        param.SharedMapDataSet = CartoType::FrameworkMapDataSet::New(error,param.SharedEngine,param.MapFileName);
+    if (!error)
+        MeasureStartup("framework_new_shared",param);
+    }
+
+/** Measures the time taken to create a framework, and the time taken by the first tile it draws (zoom level 14 at the map center). */
+void Benchmark::MeasureStartup(const char* aName,const CartoType::Framework::Param& aParam)
+    {
+    Measurement m(aName);
+    Measurement first_tile(std::string(aName) + "_first_tile");
+    CartoType::PointFP center = PointInExtent(m_extent,0.5,0.5);
+    for (int32_t i = 0; i < m_param.Iterations; i++)
+        {
+        CartoType::Result error;
+        m_profiler.BeginFrame(aName);
+        Stopwatch stopwatch;
+        auto framework = CartoType::Framework::New(error,aParam);
+        double t = stopwatch.Seconds();
+        m_profiler.EndFrame();
+        if (error)
+            {
+            m.AddError(error);
+            continue;
+            }
+        m.Add(t);
+
+        stopwatch = Stopwatch();
+        framework->TileBitmap(error,m_param.TileSize,14,TileX(center.X,14),TileY(center.Y,14));
+        t = stopwatch.Seconds();
+        error ? first_tile.AddError(error) : first_tile.Add(t);
+        }
+    m_measurements.push_back(std::move(m));
+    m_measurements.push_back(std::move(first_tile));
+    }
+
+void Benchmark::MeasureMapBitmap()
+    {
+    // Fixed view states: the map center and two off-center points at a range of scales, with and without rotation.
+    static const double scale_array[] = { 5000, 20000, 100000, 500000 };
+    static const double center_array[][2] = { { 0.5, 0.5 }, { 0.35, 0.6 }, { 0.65, 0.4 } };
+    static const double rotation_array[] = { 0, 30 };
+
+    Measurement m("map_bitmap");
+    CartoType::ViewState view_state = m_framework->ViewState();
+    int32_t view_count = 0;
+    for (double scale : scale_array)
+        for (const auto& center : center_array)
+            for (double rotation : rotation_array)
+                {
+                view_state.ViewCenterDegrees = PointInExtent(m_extent,center[0],center[1]);
+                view_state.ScaleDenominator = scale;
+                view_state.RotationDegrees = rotation;
+                view_count++;
+                for (int32_t i = 0; i < m_param.Iterations; i++)
+                    {
+                    CartoType::Result error = m_framework->SetView(view_state);
+                    if (!error)
+                        {
+                        m_framework->ForceRedraw();
+                        m_profiler.BeginFrame("map_bitmap");
+                        Stopwatch stopwatch;
+                        m_framework->MapBitmap(error);
+                        double t = stopwatch.Seconds();
+                        m_profiler.EndFrame();
+                        if (!error)
+                            m.Add(t);
+                        }
+                    if (error)
+                        m.AddError(error);
+                    }
+                }
+    m.SetProperty("view_states",view_count);
+    m.SetProperty("width",m_param.ViewWidth);
+    m.SetProperty("height",m_param.ViewHeight);
+    m_measurements.push_back(std::move(m));
+    }
+
+void Benchmark::MeasureTileBitmap()
+    {
+    // Render a pyramid of tiles covering the centre of the map for zoom levels 10 to 17,
+    // limiting the number of tiles at each level so that deep levels do not dominate.
+    const int32_t max_tiles_per_side = 8;
+    CartoType::PointFP center = PointInExtent(m_extent,0.5,0.5);
+    Measurement png("png_encode");
+    for (int32_t zoom = 10; zoom <= 17; zoom++)
+        {
+        Measurement m("tile_bitmap_z" + std::to_string(zoom));
+        int32_t min_x = TileX(m_extent.Min.X,zoom), max_x = TileX(m_extent.Max.X,zoom);
+        int32_t min_y = TileY(m_extent.Max.Y,zoom), max_y = TileY(m_extent.Min.Y,zoom);
+        int32_t cx = TileX(center.X,zoom), cy = TileY(center.Y,zoom);
+        min_x = std::max(min_x,cx - max_tiles_per_side / 2);
+        max_x = std::min(max_x,min_x + max_tiles_per_side - 1);
+        min_y = std::max(min_y,cy - max_tiles_per_side / 2);
+        max_y = std::min(max_y,min_y + max_tiles_per_side - 1);
+        int32_t tile_count = 0;
+        for (int32_t y = min_y; y <= max_y; y++)
+            for (int32_t x = min_x; x <= max_x; x++)
+                {
+                CartoType::Result error;
+                m_profiler.BeginFrame("tile_bitmap");
+                Stopwatch stopwatch;
+                CartoType::Bitmap bitmap = m_framework->TileBitmap(error,m_param.TileSize,zoom,x,y);
+                double t = stopwatch.Seconds();
+                if (error)
+                    m.AddError(error);
+                else
+                    {
+                    m.Add(t);
+
+                    // Tile servers send tiles as PNG, so encoding is part of the cost of a tile.
+                    CartoType::MemoryOutputStream output;
+                    stopwatch = Stopwatch();
+                        {
+                        CartoType::ScopedTimer timer(CartoType::ProfileStage::PngEncode);
+                        error = bitmap.WritePng(output,false);
+                        }
+                    t = stopwatch.Seconds();
+                    error ? png.AddError(error) : png.Add(t);
+                    }
+                m_profiler.EndFrame();
+                tile_count++;
+                }
+        m.SetProperty("zoom",zoom);
+        m.SetProperty("tiles",tile_count);
+        m_measurements.push_back(std::move(m));
+        }
+    m_measurements.push_back(std::move(png));
+    }
+
+void Benchmark::MeasureFind()
+    {
+    Measurement find("find");
+    Measurement find_text("find_text");
+    Measurement find_address("find_address");
+
+    CartoType::FindParam find_param;
+    find_param.MaxObjectCount = 1000;
+    find_param.TimeOut = 0;
+    CartoType::PointFP p0 = PointInExtent(m_extent,0.4,0.4);
+    CartoType::PointFP p1 = PointInExtent(m_extent,0.6,0.6);
+    find_param.Clip = CartoType::Geometry(CartoType::RectFP(p0.X,p0.Y,p1.X,p1.Y),CartoType::CoordType::Degree);
+
+    CartoType::Address address;
+    address.Street = "Pacific Avenue";
+    address.Locality = "Santa Cruz";
+
+    for (int32_t i = 0; i < m_param.Iterations; i++)
+        {
+        CartoType::MapObjectArray objects;
+        Stopwatch stopwatch;
+        CartoType::Result error = m_framework->Find(objects,find_param);
+        double t = stopwatch.Seconds();
+        error ? find.AddError(error) : find.Add(t);
+
+        objects.clear();
+        stopwatch = Stopwatch();
+        error = m_framework->FindText(objects,100,"Santa",CartoType::StringMatchMethod::Prefix,"","");
+        t = stopwatch.Seconds();
+        error ? find_text.AddError(error) : find_text.Add(t);
+
+        objects.clear();
+        stopwatch = Stopwatch();
+        error = m_framework->FindAddress(objects,100,address,false);
+        t = stopwatch.Seconds();
+        error ? find_address.AddError(error) : find_address.Add(t);
+        }
+
+    m_measurements.push_back(std::move(find));
+    m_measurements.push_back(std::move(find_text));
+    m_measurements.push_back(std::move(find_address));
+    }
+
+CartoType::RouteCoordSet Benchmark::RouteEnds(size_t aIndex) const
+    {
+    const double* e = TheRouteEnds[aIndex];
+    std::vector<CartoType::PointFP> points { PointInExtent(m_extent,e[0],e[1]),PointInExtent(m_extent,e[2],e[3]) };
+    return CartoType::RouteCoordSet(points,CartoType::CoordType::Degree,CartoType::LocationMatchParam());
+    }
+
+void Benchmark::MeasureRouting()
+    {
+    static const std::pair<CartoType::RouterType,const char*> router_array[] =
+        {
+        { CartoType::RouterType::StandardAStar, "a_star" },
+        { CartoType::RouterType::TurnExpandedAStar, "turn_expanded_a_star" },
+        { CartoType::RouterType::StandardContractionHierarchy, "contraction_hierarchy" },
+        { CartoType::RouterType::TECH, "turn_expanded_contraction_hierarchy" }
+        };
+
+    CartoType::RouteProfile profile;
+    for (const auto& router : router_array)
+        {
+        Measurement m(std::string("create_route_") + router.second);
+        m_framework->SetPreferredRouterType(router.first);
+        for (int32_t i = 0; i < m_param.Iterations; i++)
+            for (size_t j = 0; j < sizeof(TheRouteEnds) / sizeof(TheRouteEnds[0]); j++)
+                {
+                CartoType::Result error;
+                CartoType::RouteCoordSet cs = RouteEnds(j);
+                Stopwatch stopwatch;
+                auto route = m_framework->CreateRoute(error,profile,cs);
+                double t = stopwatch.Seconds();
+                error ? m.AddError(error) : m.Add(t);
+                }
+        m.SetProperty("actual_router_type",(int64_t)m_framework->ActualRouterType());
+        m_measurements.push_back(std::move(m));
+        }
+    m_framework->SetPreferredRouterType(CartoType::RouterType::Default);
+    }
+
+void Benchmark::MeasureMatrix()
+    {
+    // A 10 x 10 matrix between points on a regular grid covering the middle of the map.
+    const int32_t side = 10;
+    std::vector<CartoType::PointFP> from, to;
+    for (int32_t i = 0; i < side; i++)
+        {
+        double f = 0.3 + 0.4 * i / (side - 1);
+        from.push_back(PointInExtent(m_extent,f,0.35));
+        to.push_back(PointInExtent(m_extent,0.35 + 0.3 * i / (side - 1),0.65));
+        }
+
+    Measurement m("time_and_distance_matrix");
+    for (int32_t i = 0; i < m_param.Iterations; i++)
+        {
+        CartoType::Result error;
+        Stopwatch stopwatch;
+        auto matrix = m_framework->TimeAndDistanceMatrix(error,from,to,CartoType::CoordType::Degree);
+        double t = stopwatch.Seconds();
+        error ? m.AddError(error) : m.Add(t);
+        }
+    m.SetProperty("from",side);
+    m.SetProperty("to",side);
+    m_measurements.push_back(std::move(m));
+    }
+
+void Benchmark::MeasureNavigation()
+    {
+    // Record a track by sampling the first fixed route every 10 metres, then replay it as one-second fixes.
+    Measurement m("navigate");
+    CartoType::Result error;
+    auto route = m_framework->CreateRoute(error,CartoType::RouteProfile(),RouteEnds(0));
+    if (error)
+        {
+        m.AddError(error);
+        m_measurements.push_back(std::move(m));
+        return;
+        }
+
+    std::vector<CartoType::PointFP> track;
+    CartoType::RouteIterator iter(*route);
+    do
+        {
+        CartoType::PointFP p(iter.Position());
+        m_framework->ConvertPoint(p.X,p.Y,CartoType::CoordType::Map,CartoType::CoordType::Degree);
+        track.push_back(p);
+        }
+    while (iter.Forward(10));
+
+    error = m_framework->UseRoute(*route,true);
+    if (error)
+        {
+        m.AddError(error);
+        m_measurements.push_back(std::move(m));
+        return;
+        }
+
+    CartoType::NavigationData nav_data;
+    nav_data.Validity = CartoType::NavigationData::KTimeValid | CartoType::NavigationData::KPositionValid;
+    for (size_t i = 0; i < track.size(); i++)
+        {
+        nav_data.Time = 1700000000.0 + i;
+        nav_data.Position = track[i];
+        Stopwatch stopwatch;
+        error = m_framework->Navigate(nav_data);
+        double t = stopwatch.Seconds();
+        error ? m.AddError(error) : m.Add(t);
+        }
+    m_framework->DeleteRoutes();
+    m.SetProperty("fixes",(int64_t)track.size());
+    m_measurements.push_back(std::move(m));
+    }
+
+void Benchmark::MeasureElevation()
+    {
+    // Heights of points scattered pseudo-randomly over the middle of the map, got by Framework::Heights and by BatchHeights,
+    // which sorts them into batches of nearby points; then elevation profiles of the fixed routes.
+    const size_t point_count = 100000;
+    std::vector<CartoType::PointFP> point;
+    uint32_t seed = 12345;
+    auto random = [&seed]() { seed = seed * 1664525 + 1013904223; return (seed >> 8) / double(1 << 24); };
+    for (size_t i = 0; i < point_count; i++)
+        point.push_back(PointInExtent(m_extent,0.25 + 0.5 * random(),0.25 + 0.5 * random()));
+    CartoType::CoordSet cs(point);
+
+    Measurement heights("heights");
+    Measurement batch_heights("batch_heights");
+    Measurement batch_heights_1("batch_heights_1_thread");
+    for (int32_t i = 0; i < m_param.Iterations; i++)
+        {
+        CartoType::Result error;
+        Stopwatch stopwatch;
+        m_framework->Heights(error,cs,CartoType::CoordType::Degree);
+        double t = stopwatch.Seconds();
+        error ? heights.AddError(error) : heights.Add(t);
+
+        stopwatch = Stopwatch();
+        CartoType::BatchHeights(error,*m_framework,cs,CartoType::CoordType::Degree);
+        t = stopwatch.Seconds();
+        error ? batch_heights.AddError(error) : batch_heights.Add(t);
+
+        stopwatch = Stopwatch();
+        CartoType::BatchHeights(error,*m_framework,cs,CartoType::CoordType::Degree,1);
+        t = stopwatch.Seconds();
+        error ? batch_heights_1.AddError(error) : batch_heights_1.Add(t);
+        }
+    for (Measurement* m : { &heights, &batch_heights, &batch_heights_1 })
+        {
+        m->SetProperty("points",(int64_t)point_count);
+        m_measurements.push_back(std::move(*m));
+        }
+
+    Measurement profile("route_elevation_profile");
+    int64_t sample_count = 0;
+    for (size_t j = 0; j < sizeof(TheRouteEnds) / sizeof(TheRouteEnds[0]); j++)
+        {
+        CartoType::Result error;
+        auto route = m_framework->CreateRoute(error,CartoType::RouteProfile(),RouteEnds(j));
+        if (error)
+            {
+            profile.AddError(error);
+            continue;
+            }
+        for (int32_t i = 0; i < m_param.Iterations; i++)
+            {
+            Stopwatch stopwatch;
+            CartoType::ElevationProfile p = CartoType::RouteElevationProfile(error,*m_framework,*route);
+            double t = stopwatch.Seconds();
+            error ? profile.AddError(error) : profile.Add(t);
+            if (!i)
+                sample_count += (int64_t)p.Height.size();
+            }
+        }
+    profile.SetProperty("samples",sample_count);
+    m_measurements.push_back(std::move(profile));
+    }
+
+void Benchmark::MeasureTerrain()
+    {
+    // Hillshading for a 4 x 4 block of tiles at zoom level 13 around the map center, made by TerrainRasterCache:
+    // from nothing, using one thread or all of them to get the heights; with the heights cached but a new light direction;
+    // and with the raster cached, as when an unchanged tile is redrawn.
+    const int32_t zoom = 13;
+    CartoType::PointFP center = PointInExtent(m_extent,0.5,0.5);
+    int32_t min_x = TileX(center.X,zoom) - 2, min_y = TileY(center.Y,zoom) - 2;
+    CartoType::TerrainRasterParam param;
+    param.TileSize = m_param.TileSize;
+
+    Measurement uncached("terrain_hillshade_uncached");
+    Measurement uncached_all_threads("terrain_hillshade_uncached_all_threads");
+    Measurement relit("terrain_hillshade_relit");
+    Measurement cached("terrain_hillshade_cached");
+    for (int32_t i = 0; i < m_param.Iterations; i++)
+        {
+        CartoType::TerrainRasterCache cache;
+        CartoType::TerrainRasterCache cache_all_threads;
+        for (int32_t y = min_y; y < min_y + 4; y++)
+            for (int32_t x = min_x; x < min_x + 4; x++)
+                {
+                CartoType::Result error;
+                param.LightAzimuth = 315;
+                param.ThreadCount = 1;
+                Stopwatch stopwatch;
+                cache.Hillshade(error,*m_framework,zoom,x,y,param);
+                double t = stopwatch.Seconds();
+                error ? uncached.AddError(error) : uncached.Add(t);
+
+                param.ThreadCount = 0;
+                stopwatch = Stopwatch();
+                cache_all_threads.Hillshade(error,*m_framework,zoom,x,y,param);
+                t = stopwatch.Seconds();
+                error ? uncached_all_threads.AddError(error) : uncached_all_threads.Add(t);
+
+                param.LightAzimuth = 270;
+                param.ThreadCount = 1;
+                stopwatch = Stopwatch();
+                cache.Hillshade(error,*m_framework,zoom,x,y,param);
+                t = stopwatch.Seconds();
+                error ? relit.AddError(error) : relit.Add(t);
+
+                stopwatch = Stopwatch();
+                cache.Hillshade(error,*m_framework,zoom,x,y,param);
+                t = stopwatch.Seconds();
+                error ? cached.AddError(error) : cached.Add(t);
+                }
+        }
+    for (Measurement* m : { &uncached, &uncached_all_threads, &relit, &cached })
+        {
+        m->SetProperty("zoom",zoom);
+        m->SetProperty("tiles",16);
+        m_measurements.push_back(std::move(*m));
+        }
+    }
+
+void Benchmark::WriteAsJson(std::ostream& aOutput) const
+    {
+    aOutput << "{\n";
+    aOutput << "  \"cartotype_version\": \"" << CartoType::Version() << "." << CartoType::Build() << "\",\n";
+    aOutput << "  \"map\": " << JsonString(m_param.MapFileName) << ",\n";
+    aOutput << "  \"iterations\": " << m_param.Iterations << ",\n";
+    aOutput << "  \"peak_rss_kb\": " << PeakRssInKilobytes() << ",\n";
+    aOutput << "  \"results\":\n  [\n";
+    for (size_t i = 0; i < m_measurements.size(); i++)
+        {
+        m_measurements[i].WriteAsJson(aOutput);
+        aOutput << (i + 1 < m_measurements.size() ? ",\n" : "\n");
+        }
+    aOutput << "  ]";
+    if (m_profiler.Enabled())
+        {
+        aOutput << ",\n";
+        WriteProfileAsJson(aOutput);
+        }
+    aOutput << "\n}\n";
+    }
+
+/** Writes the profiler counters summed over all frames of each name. */
+void Benchmark::WriteProfileAsJson(std::ostream& aOutput) const
+    {
+    std::vector<CartoType::FrameProfile> total_array;
+    for (const auto& frame : m_profiler.Frames())
+        {
+        auto iter = std::find_if(total_array.begin(),total_array.end(),[&frame](const CartoType::FrameProfile& aP) { return aP.Name == frame.Name; });
+        if (iter == total_array.end())
+            {
+            total_array.emplace_back();
+            iter = total_array.end() - 1;
+            iter->Name = frame.Name;
+            }
+        iter->Seconds += frame.Seconds;
+        for (size_t i = 0; i < CartoType::KProfileStageCount; i++)
+            {
+            iter->Counter[i].Count += frame.Counter[i].Count;
+            iter->Counter[i].Seconds += frame.Counter[i].Seconds;
+            }
+        }
+
+    aOutput << "  \"profile\":\n  {\n";
+    for (size_t i = 0; i < total_array.size(); i++)
+        {
+        const auto& total = total_array[i];
+        aOutput << "    " << JsonString(total.Name) << ": { \"total_ms\": " << total.Seconds * 1000;
+        for (size_t j = 0; j < CartoType::KProfileStageCount; j++)
+            {
+            const auto& c = total.Counter[j];
+            if (c.Count)
+                aOutput << ", \"" << CartoType::ProfileStageName(CartoType::ProfileStage(j)) << "\": { \"count\": " << c.Count << ", \"ms\": " << c.Seconds * 1000 << " }";
+            }
+        aOutput << " }" << (i + 1 < total_array.size() ? ",\n" : "\n");
+        }
+    aOutput << "  }";
+    }
+
+bool ParseArguments(int aArgc,char** aArgv,BenchmarkParam& aParam)
+    {
+    for (int i = 1; i < aArgc; i++)
+        {
+        std::string arg = aArgv[i];
+        if (i + 1 >= aArgc)
+            return false;
+        std::string value = aArgv[++i];
+        if (arg == "--map")
+            aParam.MapFileName = value;
+        else if (arg == "--style")
+            aParam.StyleSheetFileName = value;
+        else if (arg == "--font")
+            aParam.FontFileName = value;
+        else if (arg == "--output")
+            aParam.OutputFileName = value;
+        else if (arg == "--trace")
+            aParam.TraceFileName = value;
+        else if (arg == "--iterations")
+            aParam.Iterations = std::max(1,atoi(value.c_str()));
+        else
+            return false;
+        }
+    return true;
+    }
+
+}
+
+int main(int argc,char** argv)
+    {
+    BenchmarkParam param;
+    if (!ParseArguments(argc,argv,param))
+        {
+        std::cerr << "usage: unix_benchmark [--map FILE] [--style FILE] [--font FILE] [--iterations N] [--output FILE] [--trace FILE]\n";
+        return 2;
+        }
+
+    Benchmark benchmark(param);
+    CartoType::Result error = benchmark.Run();
+    if (error)
+        {
+        std::cerr << "benchmark failed: error " << (uint32_t)error << "\n";
+        return 1;
+        }
+
+    if (param.OutputFileName.empty())
+        benchmark.WriteAsJson(std::cout);
+    else
+        {
+        std::ofstream output(param.OutputFileName);
+        benchmark.WriteAsJson(output);
+        }
+    return 0;
+    }
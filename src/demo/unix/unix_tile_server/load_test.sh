@@ -0,0 +1,66 @@
+#!/bin/sh
+# load_test.sh
+# Copyright (C) 2024 CartoType Ltd.
+# See www.cartotype.com for more information.
+#
+# A load test for unix_tile_server using curl. Start the server first, then run
+#
+#   ./load_test.sh [HOST:PORT] [LONGITUDE] [LATITUDE] [ZOOM] [CLIENTS]
+#
+# The defaults are localhost:8080 and the centre of the Santa Cruz sample map at zoom 14,
+# with 16 concurrent clients. The test checks the health endpoint, fetches a 4x4 block of
+# tiles with every client asking for every tile at once (cache-cold requests which the server
+# should coalesce), fetches them again over a single kept-alive connection, and checks
+# that a conditional request with the tile's ETag is answered with 304. Timings are summarized
+# as the mean, median and 95th percentile of curl's total time for each request.
+
+SERVER=${1:-localhost:8080}
+LONGITUDE=${2:--122.03}
+LATITUDE=${3:-36.97}
+ZOOM=${4:-14}
+CLIENTS=${5:-16}
+
+fail()
+    {
+    echo "FAILED: $1"
+    exit 1
+    }
+
+summarize()
+    {
+    sort -n -k2 | awk -v name="$1" '
+        { code[NR] = $1; time[NR] = $2; total += $2; if ($1 != "200") bad++ }
+        END {
+            if (NR == 0) { print name ": no requests"; exit 1 }
+            p50 = time[int((NR - 1) * 0.5) + 1]; p95 = time[int((NR - 1) * 0.95) + 1]
+            printf "%-10s %5d requests  %3d failed  mean %.4fs  p50 %.4fs  p95 %.4fs\n", name, NR, bad, total / NR, p50, p95
+            exit bad > 0
+            }'
+    }
+
+# The tile containing the given point, and a block of 4x4 tiles starting there.
+set -- $(awk -v lon="$LONGITUDE" -v lat="$LATITUDE" -v z="$ZOOM" 'BEGIN {
+    pi = atan2(0, -1); n = 2 ^ z; r = lat * pi / 180
+    x = int((lon + 180) / 360 * n)
+    y = int((1 - log(sin(r) / cos(r) + 1 / cos(r)) / pi) / 2 * n)
+    print x - 2, y - 2 }')
+X0=$1
+Y0=$2
+URLS=$(for dx in 0 1 2 3; do for dy in 0 1 2 3; do echo "http://$SERVER/tile/$ZOOM/$((X0 + dx))/$((Y0 + dy)).png"; done; done)
+
+[ "$(curl -s "http://$SERVER/health")" = "ok" ] || fail "server not answering at $SERVER"
+
+for url in $URLS; do
+    i=0
+    while [ $i -lt "$CLIENTS" ]; do echo "$url"; i=$((i + 1)); done
+done | xargs -P "$CLIENTS" -n 1 curl -s -o /dev/null -w "%{http_code} %{time_total}\n" | summarize "cold" || fail "cold tiles"
+
+curl -s $(for url in $URLS; do echo "-o /dev/null $url"; done) -w "%{http_code} %{time_total}\n" | summarize "keep-alive" || fail "keep-alive tiles"
+
+URL=$(echo "$URLS" | head -n 1)
+ETAG=$(curl -s -D - -o /dev/null "$URL" | tr -d '\r' | awk 'tolower($1) == "etag:" { print $2 }')
+[ -n "$ETAG" ] || fail "no ETag"
+CODE=$(curl -s -o /dev/null -w "%{http_code}" -H "If-None-Match: $ETAG" "$URL")
+[ "$CODE" = "304" ] || fail "conditional request returned $CODE, not 304"
+echo "etag       $ETAG answered with 304"
+echo "passed"
@@ -0,0 +1,822 @@
+/*
+unix_tile_server.cpp
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+
+A small HTTP/1.1 map server with no dependencies other than CartoType and the
+Linux system calls. One thread runs an epoll event loop which accepts
+connections, parses requests and writes responses; a pool of worker threads,
+each owning a Framework which shares a single engine and map data set with the
+others, does the drawing and the queries.
+
+Endpoints:
+
+GET /tile/Z/X/Y.png     a PNG map tile in the usual web Mercator tiling scheme
+GET|POST /find?...      passed to Framework::HandleQuery
+GET|POST /route?...     passed to Framework::HandleQuery
+GET|POST /matrix?...    passed to Framework::HandleQuery
+GET /health             returns "ok"
+
+For the query endpoints the request target, without its leading slash, is the
+query, and the request body, if any, is the data.
+
+Connections are kept alive and pipelined requests are answered in order. Tiles
+carry strong ETags made from a hash of the style sheet and the map file's size
+and modification time, so that a conditional request for an unchanged tile is
+answered with 304 Not Modified by the event loop without drawing anything.
+Identical tile requests arriving while the tile is being drawn wait for that
+drawing and share its result, using TileRenderCoalescer.
+
+Usage: unix_tile_server [--map FILE] [--style FILE] [--font FILE] [--port N] [--threads N] [--tile-size N] [--max-age SECONDS]
+
+load_test.sh, in this directory, exercises a running server using curl.
+*/
+
+#include <cartotype.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+
+/** Server settings; the defaults use the data shipped with the SDK. */
+class ServerParam
+    {
+    public:
+    std::string MapFileName = "../../../../src/test/data/ctm1/santa-cruz.ctm1";
+    std::string StyleSheetFileName = "../../../../style/standard.ctstyle";
+    std::string FontFileName = "../../../../font/DejaVuSans.ttf";
+    int32_t Port = 8080;
+    int32_t ThreadCount = int32_t(std::max(1U,std::thread::hardware_concurrency()));
+    int32_t TileSize = 256;
+    int32_t MaxAge = 3600;
+    };
+
+/** The largest request head or body accepted. */
+constexpr size_t KMaxHeadSize = 64 * 1024;
+constexpr size_t KMaxBodySize = 16 * 1024 * 1024;
+/** The most unparsed input buffered for a connection: one request of the largest size. */
+constexpr size_t KMaxInputSize = KMaxHeadSize + KMaxBodySize;
+
+std::atomic<bool> TheStopFlag { false };
+
+void Stop(int)
+    {
+    TheStopFlag = true;
+    }
+
+/**
+Returns a hash identifying the style sheet and map data used to draw tiles.
+It changes if the style sheet's contents change or the map file is replaced.
+*/
+uint64_t DataHash(const ServerParam& aParam)
+    {
+    std::ifstream style(aParam.StyleSheetFileName,std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(style)),std::istreambuf_iterator<char>());
+    CartoType::Hasher64 hasher;
+    hasher.Add(text);
+    struct stat s;
+    if (stat(aParam.MapFileName.c_str(),&s) == 0)
+        hasher.AddValue(int64_t(s.st_size)).AddValue(int64_t(s.st_mtime));
+    hasher.Add(aParam.MapFileName).AddValue(aParam.TileSize);
+    return hasher.Value();
+    }
+
+/** A parsed HTTP request. */
+class HttpRequest
+    {
+    public:
+    std::string Method;
+    std::string Target;
+    std::string Path;
+    std::string IfNoneMatch;
+    std::string Body;
+    bool KeepAlive = true;
+    };
+
+/** An HTTP response. */
+class HttpResponse
+    {
+    public:
+    HttpResponse() = default;
+    HttpResponse(int aStatus,const std::string& aContentType,std::string aBody):
+        Status(aStatus),
+        ContentType(aContentType),
+        Body(std::move(aBody))
+        {
+        }
+
+    /** Returns the response as the bytes to be sent, except for the tile data, if any, which are sent after them. */
+    std::string Serialize(bool aKeepAlive) const
+        {
+        std::string s = "HTTP/1.1 " + std::to_string(Status) + " " + Reason() + "\r\n";
+        if (!ContentType.empty())
+            s += "Content-Type: " + ContentType + "\r\n";
+        if (!ETag.empty())
+            s += "ETag: " + ETag + "\r\n";
+        if (!CacheControl.empty())
+            s += "Cache-Control: " + CacheControl + "\r\n";
+        s += "Content-Length: " + std::to_string(Tile ? Tile->Data.Size() : Body.size()) + "\r\n";
+        s += aKeepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        s += Body;
+        return s;
+        }
+
+    int Status = 200;
+    std::string ContentType;
+    std::string Body;
+    std::string ETag;
+    std::string CacheControl;
+    /** If not null, a tile whose PNG data are the body, sent from the tile's pooled buffer without copying them. */
+    std::shared_ptr<const CartoType::EncodedTile> Tile;
+
+    private:
+    const char* Reason() const
+        {
+        switch (Status)
+            {
+            case 200: return "OK";
+            case 304: return "Not Modified";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 413: return "Payload Too Large";
+            case 431: return "Request Header Fields Too Large";
+            case 500: return "Internal Server Error";
+            case 501: return "Not Implemented";
+            default: return "Unknown";
+            }
+        }
+    };
+
+/** The result of trying to parse a request from the start of a buffer. */
+enum class ParseResult
+    {
+    Incomplete,
+    Complete,
+    Error
+    };
+
+std::string Lower(std::string aText)
+    {
+    for (auto& c : aText)
+        c = char(tolower((unsigned char)c));
+    return aText;
+    }
+
+/**
+Parses a request from the start of aBuffer. If it is complete, removes it from the buffer.
+If there is an error, aErrorStatus is set to the status to be returned.
+*/
+ParseResult ParseRequest(std::string& aBuffer,HttpRequest& aRequest,int& aErrorStatus)
+    {
+    size_t head_end = aBuffer.find("\r\n\r\n");
+    if (head_end == std::string::npos)
+        {
+        aErrorStatus = 431;
+        return aBuffer.size() > KMaxHeadSize ? ParseResult::Error : ParseResult::Incomplete;
+        }
+
+    aErrorStatus = 400;
+    std::istringstream head(aBuffer.substr(0,head_end));
+    std::string line;
+    std::getline(head,line);
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+    std::istringstream request_line(line);
+    std::string version;
+    if (!(request_line >> aRequest.Method >> aRequest.Target >> version) || aRequest.Target.empty() || aRequest.Target[0] != '/')
+        return ParseResult::Error;
+    aRequest.KeepAlive = version == "HTTP/1.1";
+    aRequest.Path = aRequest.Target.substr(0,aRequest.Target.find('?'));
+
+    size_t content_length = 0;
+    while (std::getline(head,line))
+        {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            return ParseResult::Error;
+        std::string name = Lower(line.substr(0,colon));
+        size_t value_start = line.find_first_not_of(" \t",colon + 1);
+        std::string value = value_start == std::string::npos ? std::string() : line.substr(value_start);
+        if (name == "content-length")
+            content_length = strtoull(value.c_str(),nullptr,10);
+        else if (name == "connection")
+            {
+            value = Lower(value);
+            if (value == "close")
+                aRequest.KeepAlive = false;
+            else if (value == "keep-alive")
+                aRequest.KeepAlive = true;
+            }
+        else if (name == "if-none-match")
+            aRequest.IfNoneMatch = value;
+        else if (name == "transfer-encoding")
+            {
+            aErrorStatus = 501;
+            return ParseResult::Error;
+            }
+        }
+
+    if (content_length > KMaxBodySize)
+        {
+        aErrorStatus = 413;
+        return ParseResult::Error;
+        }
+    size_t body_start = head_end + 4;
+    if (aBuffer.size() - body_start < content_length)
+        return ParseResult::Incomplete;
+    aRequest.Body = aBuffer.substr(body_start,content_length);
+    aBuffer.erase(0,body_start + content_length);
+    return ParseResult::Complete;
+    }
+
+/** Parses a path of the form /tile/Z/X/Y.png. */
+bool ParseTilePath(const std::string& aPath,int32_t& aZoom,int32_t& aX,int32_t& aY)
+    {
+    char tail[8] = { };
+    if (sscanf(aPath.c_str(),"/tile/%d/%d/%d%7s",&aZoom,&aX,&aY,tail) != 4 || strcmp(tail,".png"))
+        return false;
+    if (aZoom < 0 || aZoom > 30)
+        return false;
+    int64_t tiles = int64_t(1) << aZoom;
+    return aX >= 0 && aX < tiles && aY >= 0 && aY < tiles;
+    }
+
+/** A job for the worker pool: a request and the connection to send the response to. */
+class Job
+    {
+    public:
+    int Socket = -1;
+    uint64_t ConnectionId = 0;
+    HttpRequest Request;
+    };
+
+/** A response produced by a worker. */
+class Completion
+    {
+    public:
+    int Socket = -1;
+    uint64_t ConnectionId = 0;
+    std::string Data;
+    std::shared_ptr<const CartoType::EncodedTile> Tile;
+    bool KeepAlive = true;
+    };
+
+/** Draws tiles and answers queries using a pool of threads, each with its own framework. */
+class WorkerPool
+    {
+    public:
+    WorkerPool(const ServerParam& aParam,uint64_t aDataHash,int aEventFd):
+        m_param(aParam),
+        m_data_hash(aDataHash),
+        m_event_fd(aEventFd)
+        {
+        }
+
+    ~WorkerPool()
+        {
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            }
+        m_condition.notify_all();
+        for (auto& t : m_thread_array)
+            t.join();
+        }
+
+    /** Creates the frameworks and starts the threads. */
+    CartoType::Result Start()
+        {
+        CartoType::Framework::Param param;
+        param.MapFileName = m_param.MapFileName.c_str();
+        param.StyleSheetFileName = m_param.StyleSheetFileName.c_str();
+        param.FontFileName = m_param.FontFileName.c_str();
+        param.ViewWidth = m_param.TileSize;
+        param.ViewHeight = m_param.TileSize;
+        // Signals are handled by the event loop, so block them in the worker threads, which inherit this thread's mask.
+        sigset_t signal_set, old_signal_set;
+        sigemptyset(&signal_set);
+        sigaddset(&signal_set,SIGINT);
+        sigaddset(&signal_set,SIGTERM);
+        pthread_sigmask(SIG_BLOCK,&signal_set,&old_signal_set);
+        CartoType::Result error;
+        param.SharedEngine = CartoType::FrameworkEngine::New(error,param.FontFileName);
+        if (!error)
+            param.SharedMapDataSet = CartoType::FrameworkMapDataSet::New(error,param.SharedEngine,param.MapFileName);
+        for (int32_t i = 0; i < m_param.ThreadCount && !error; i++)
+            {
+            std::shared_ptr<CartoType::Framework> framework = CartoType::Framework::New(error,param);
+            if (!error)
+                m_thread_array.emplace_back([this,framework]() { Run(*framework); });
+            }
+        pthread_sigmask(SIG_SETMASK,&old_signal_set,nullptr);
+        return error;
+        }
+
+    void Submit(Job&& aJob)
+        {
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job_queue.push_back(std::move(aJob));
+            }
+        m_condition.notify_one();
+        }
+
+    /** Removes and returns the finished responses. */
+    std::vector<Completion> TakeCompletions()
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<Completion> c;
+        c.swap(m_completion_array);
+        return c;
+        }
+
+    /** Returns the tile render coalescer, which counts the tiles drawn and shared. */
+    const CartoType::TileRenderCoalescer& TileCoalescer() const { return m_tile_coalescer; }
+
+    /** Returns the ETag of a tile. */
+    std::string TileETag(int32_t aZoom,int32_t aX,int32_t aY) const
+        {
+        int32_t coord[3] = { aZoom, aX, aY };
+        char buffer[24];
+        snprintf(buffer,sizeof(buffer),"\"%016llx\"",(unsigned long long)CartoType::Hash64(coord,sizeof(coord),m_data_hash));
+        return buffer;
+        }
+
+    private:
+    void Run(CartoType::Framework& aFramework)
+        {
+        for (;;)
+            {
+            Job job;
+                {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock,[this]() { return m_stop || !m_job_queue.empty(); });
+                if (m_stop)
+                    return;
+                job = std::move(m_job_queue.front());
+                m_job_queue.pop_front();
+                }
+
+            HttpResponse response = Handle(aFramework,job.Request);
+            Completion c;
+            c.Socket = job.Socket;
+            c.ConnectionId = job.ConnectionId;
+            c.KeepAlive = job.Request.KeepAlive;
+            c.Data = response.Serialize(c.KeepAlive);
+            c.Tile = std::move(response.Tile);
+                {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_completion_array.push_back(std::move(c));
+                }
+            uint64_t one = 1;
+            (void)!write(m_event_fd,&one,sizeof(one));
+            }
+        }
+
+    HttpResponse Handle(CartoType::Framework& aFramework,const HttpRequest& aRequest)
+        {
+        int32_t zoom, x, y;
+        if (ParseTilePath(aRequest.Path,zoom,x,y))
+            return Tile(aFramework,zoom,x,y);
+        std::string answer = aFramework.HandleQuery(aRequest.Target.substr(1),aRequest.Body);
+        if (answer.empty())
+            return HttpResponse(400,"text/plain","query failed\n");
+        bool json = answer[0] == '{' || answer[0] == '[';
+        return HttpResponse(200,json ? "application/json" : "text/plain; charset=utf-8",std::move(answer));
+        }
+
+    /** Returns a tile, drawing it or sharing the result of an identical request which is already drawing it. */
+    HttpResponse Tile(CartoType::Framework& aFramework,int32_t aZoom,int32_t aX,int32_t aY)
+        {
+        auto tile = m_tile_coalescer.PngTile(aFramework,m_data_hash,m_param.TileSize,aZoom,aX,aY);
+        if (tile->Error)
+            return HttpResponse(500,"text/plain","error " + std::to_string(uint32_t(tile->Error)) + "\n");
+        HttpResponse response(200,"image/png","");
+        response.Tile = tile;
+        response.ETag = TileETag(aZoom,aX,aY);
+        response.CacheControl = "public, max-age=" + std::to_string(m_param.MaxAge);
+        return response;
+        }
+
+    const ServerParam& m_param;
+    uint64_t m_data_hash;
+    int m_event_fd;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<Job> m_job_queue;
+    std::vector<Completion> m_completion_array;
+    bool m_stop = false;
+    std::vector<std::thread> m_thread_array;
+    CartoType::TileRenderCoalescer m_tile_coalescer;
+    };
+
+/** A client connection. */
+class Connection
+    {
+    public:
+    /** Returns the number of bytes of output: Output followed by OutputTile's data. */
+    size_t OutputSize() const { return Output.size() + (OutputTile ? OutputTile->Data.Size() : 0); }
+    /** Returns true if there is output still to be written. */
+    bool Writing() const { return OutputOffset < OutputSize(); }
+
+    uint64_t Id = 0;
+    std::string Input;
+    std::string Output;
+    std::shared_ptr<const CartoType::EncodedTile> OutputTile;
+    size_t OutputOffset = 0;
+    bool Busy = false;
+    bool Closing = false;
+    bool PeerClosed = false;
+    };
+
+/** The epoll event loop. */
+class Server
+    {
+    public:
+    explicit Server(const ServerParam& aParam):
+        m_param(aParam)
+        {
+        }
+
+    ~Server()
+        {
+        m_worker_pool = nullptr;
+        for (auto& c : m_connection_map)
+            close(c.first);
+        for (int fd : { m_listen_fd, m_event_fd, m_epoll_fd })
+            if (fd >= 0)
+                close(fd);
+        }
+
+    int Run()
+        {
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        m_event_fd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_epoll_fd < 0 || m_event_fd < 0 || !Listen())
+            {
+            std::cerr << "cannot listen on port " << m_param.Port << ": " << strerror(errno) << "\n";
+            return 1;
+            }
+
+        m_worker_pool = std::make_unique<WorkerPool>(m_param,DataHash(m_param),m_event_fd);
+        CartoType::Result error = m_worker_pool->Start();
+        if (error)
+            {
+            std::cerr << "cannot create frameworks: error " << uint32_t(error) << "\n";
+            return 1;
+            }
+        Watch(m_listen_fd,EPOLLIN,EPOLL_CTL_ADD);
+        Watch(m_event_fd,EPOLLIN,EPOLL_CTL_ADD);
+        std::cerr << "listening on port " << m_param.Port << " with " << m_param.ThreadCount << " worker threads\n";
+
+        std::vector<epoll_event> event_array(256);
+        while (!TheStopFlag)
+            {
+            int n = epoll_wait(m_epoll_fd,event_array.data(),int(event_array.size()),-1);
+            if (n < 0)
+                {
+                if (errno == EINTR)
+                    continue;
+                return 1;
+                }
+            for (int i = 0; i < n; i++)
+                {
+                int fd = event_array[i].data.fd;
+                if (fd == m_listen_fd)
+                    Accept();
+                else if (fd == m_event_fd)
+                    Complete();
+                else
+                    HandleSocket(fd,event_array[i].events);
+                }
+            }
+        const auto& coalescer = m_worker_pool->TileCoalescer();
+        std::cerr << "tiles drawn: " << coalescer.Renders() << "; requests sharing a render: " << coalescer.SharedRenders() << "\n";
+        std::cerr << "PNG buffers reused: " << coalescer.Pool().Hits() << "; allocated: " << coalescer.Pool().Misses() << "\n";
+        return 0;
+        }
+
+    private:
+    bool Listen()
+        {
+        m_listen_fd = socket(AF_INET6,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+        if (m_listen_fd < 0)
+            return false;
+        int on = 1, off = 0;
+        setsockopt(m_listen_fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        setsockopt(m_listen_fd,IPPROTO_IPV6,IPV6_V6ONLY,&off,sizeof(off));
+        sockaddr_in6 address = { };
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(uint16_t(m_param.Port));
+        return bind(m_listen_fd,reinterpret_cast<sockaddr*>(&address),sizeof(address)) == 0 && listen(m_listen_fd,SOMAXCONN) == 0;
+        }
+
+    void Watch(int aFd,uint32_t aEvents,int aOperation)
+        {
+        epoll_event e = { };
+        e.events = aEvents;
+        e.data.fd = aFd;
+        if (epoll_ctl(m_epoll_fd,aOperation,aFd,&e) && aOperation == EPOLL_CTL_MOD && errno == ENOENT)
+            epoll_ctl(m_epoll_fd,EPOLL_CTL_ADD,aFd,&e);
+        }
+
+    void Accept()
+        {
+        for (;;)
+            {
+            int fd = accept4(m_listen_fd,nullptr,nullptr,SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            int on = 1;
+            setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+            Connection& c = m_connection_map[fd];
+            c = Connection();
+            c.Id = ++m_last_connection_id;
+            Watch(fd,EPOLLIN | EPOLLRDHUP,EPOLL_CTL_ADD);
+            }
+        }
+
+    void Close(int aFd)
+        {
+        epoll_ctl(m_epoll_fd,EPOLL_CTL_DEL,aFd,nullptr);
+        close(aFd);
+        m_connection_map.erase(aFd);
+        }
+
+    void HandleSocket(int aFd,uint32_t aEvents)
+        {
+        auto p = m_connection_map.find(aFd);
+        if (p == m_connection_map.end())
+            return;
+        Connection& c = p->second;
+        if (aEvents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+            char buffer[16384];
+            while (!c.PeerClosed && c.Input.size() <= KMaxInputSize)
+                {
+                ssize_t n = recv(aFd,buffer,sizeof(buffer),0);
+                if (n > 0)
+                    c.Input.append(buffer,size_t(n));
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                else if (n < 0 && errno == EINTR)
+                    continue;
+                else
+                    c.PeerClosed = true;
+                }
+            }
+        if (c.Writing() && !Write(aFd,c))
+            return;
+        Process(aFd,c);
+        }
+
+    /**
+    Handles the complete requests buffered on a connection, in order, until one is passed to a worker
+    or a response cannot be written at once; then closes the connection if it is finished,
+    or updates the events it is watched for.
+    */
+    void Process(int aFd,Connection& aConnection)
+        {
+        while (!aConnection.Busy && !aConnection.Closing && !aConnection.Writing())
+            {
+            HttpRequest request;
+            int error_status = 0;
+            ParseResult r = ParseRequest(aConnection.Input,request,error_status);
+            if (r == ParseResult::Incomplete)
+                break;
+            if (r == ParseResult::Error)
+                {
+                Send(aFd,aConnection,HttpResponse(error_status,"text/plain","bad request\n").Serialize(false),nullptr,false);
+                return;
+                }
+
+            HttpResponse immediate;
+            bool answered = true;
+            int32_t zoom, x, y;
+            bool tile = ParseTilePath(request.Path,zoom,x,y);
+            bool query = request.Path == "/find" || request.Path == "/route" || request.Path == "/matrix";
+            if (request.Method != "GET" && !(query && request.Method == "POST"))
+                immediate = HttpResponse(405,"text/plain","method not allowed\n");
+            else if (request.Path == "/health")
+                immediate = HttpResponse(200,"text/plain","ok\n");
+            else if (tile)
+                {
+                std::string etag = m_worker_pool->TileETag(zoom,x,y);
+                if (request.IfNoneMatch == etag || request.IfNoneMatch == "*")
+                    {
+                    immediate = HttpResponse(304,"","");
+                    immediate.ETag = etag;
+                    }
+                else
+                    answered = false;
+                }
+            else if (!query)
+                immediate = HttpResponse(404,"text/plain","not found\n");
+            else
+                answered = false;
+
+            if (answered)
+                {
+                if (!Send(aFd,aConnection,immediate.Serialize(request.KeepAlive),nullptr,request.KeepAlive))
+                    return;
+                continue;
+                }
+
+            aConnection.Busy = true;
+            Job job;
+            job.Socket = aFd;
+            job.ConnectionId = aConnection.Id;
+            job.Request = std::move(request);
+            m_worker_pool->Submit(std::move(job));
+            }
+
+        bool idle = !aConnection.Busy && !aConnection.Writing();
+        if ((aConnection.PeerClosed && idle) || aConnection.Input.size() > KMaxInputSize)
+            {
+            // The peer has gone and everything it sent has been answered, or it has sent more than can be buffered while its requests are handled.
+            Close(aFd);
+            return;
+            }
+        UpdateWatch(aFd,aConnection);
+        }
+
+    /**
+    Watches for input unless the peer has closed its side, when a level-triggered EPOLLRDHUP would be reported continually,
+    and for the socket becoming writable if there is output waiting.
+    */
+    void UpdateWatch(int aFd,const Connection& aConnection)
+        {
+        uint32_t events = aConnection.PeerClosed ? 0 : EPOLLIN | EPOLLRDHUP;
+        if (aConnection.Writing())
+            events |= EPOLLOUT;
+        if (events)
+            Watch(aFd,events,EPOLL_CTL_MOD);
+        else
+            epoll_ctl(m_epoll_fd,EPOLL_CTL_DEL,aFd,nullptr);
+        }
+
+    /**
+    Starts sending a response, consisting of aData followed by the data of aTile if it is not null, on a connection
+    with no output waiting, and writes as much of it as possible. Returns false if the connection has been closed.
+    */
+    bool Send(int aFd,Connection& aConnection,std::string&& aData,std::shared_ptr<const CartoType::EncodedTile> aTile,bool aKeepAlive)
+        {
+        aConnection.Output = std::move(aData);
+        aConnection.OutputTile = std::move(aTile);
+        aConnection.OutputOffset = 0;
+        if (!aKeepAlive)
+            aConnection.Closing = true;
+        return Write(aFd,aConnection);
+        }
+
+    /**
+    Writes as much output as possible. Closes the connection if there is an error, or if all the output
+    has been written and the connection is to be closed. Returns false if the connection has been closed.
+    */
+    bool Write(int aFd,Connection& aConnection)
+        {
+        while (aConnection.Writing())
+            {
+            // Gather the rest of the head and the tile data, if any, into one call.
+            iovec io[2];
+            msghdr message = { };
+            message.msg_iov = io;
+            size_t head_size = aConnection.Output.size();
+            if (aConnection.OutputOffset < head_size)
+                io[message.msg_iovlen++] = { &aConnection.Output[aConnection.OutputOffset], head_size - aConnection.OutputOffset };
+            if (aConnection.OutputTile)
+                {
+                const auto& data = aConnection.OutputTile->Data;
+                size_t offset = std::max(aConnection.OutputOffset,head_size) - head_size;
+                io[message.msg_iovlen++] = { const_cast<uint8_t*>(data.Data()) + offset, data.Size() - offset };
+                }
+            ssize_t n = sendmsg(aFd,&message,MSG_NOSIGNAL);
+            if (n > 0)
+                aConnection.OutputOffset += size_t(n);
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                UpdateWatch(aFd,aConnection);
+                return true;
+                }
+            else
+                {
+                Close(aFd);
+                return false;
+                }
+            }
+
+        aConnection.Output.clear();
+        aConnection.OutputTile = nullptr;
+        aConnection.OutputOffset = 0;
+        if (aConnection.Closing)
+            {
+            Close(aFd);
+            return false;
+            }
+        return true;
+        }
+
+    /** Sends the responses finished by the workers. */
+    void Complete()
+        {
+        uint64_t count;
+        (void)!read(m_event_fd,&count,sizeof(count));
+        for (auto& c : m_worker_pool->TakeCompletions())
+            {
+            auto p = m_connection_map.find(c.Socket);
+            if (p == m_connection_map.end() || p->second.Id != c.ConnectionId)
+                continue;
+            p->second.Busy = false;
+            if (Send(c.Socket,p->second,std::move(c.Data),std::move(c.Tile),c.KeepAlive))
+                Process(c.Socket,p->second);
+            }
+        }
+
+    const ServerParam& m_param;
+    int m_epoll_fd = -1;
+    int m_event_fd = -1;
+    int m_listen_fd = -1;
+    uint64_t m_last_connection_id = 0;
+    std::unordered_map<int,Connection> m_connection_map;
+    std::unique_ptr<WorkerPool> m_worker_pool;
+    };
+
+bool ParseArguments(int aArgc,char** aArgv,ServerParam& aParam)
+    {
+    for (int i = 1; i < aArgc; i++)
+        {
+        std::string arg = aArgv[i];
+        if (i + 1 >= aArgc)
+            return false;
+        std::string value = aArgv[++i];
+        if (arg == "--map")
+            aParam.MapFileName = value;
+        else if (arg == "--style")
+            aParam.StyleSheetFileName = value;
+        else if (arg == "--font")
+            aParam.FontFileName = value;
+        else if (arg == "--port")
+            aParam.Port = atoi(value.c_str());
+        else if (arg == "--threads")
+            aParam.ThreadCount = std::max(1,atoi(value.c_str()));
+        else if (arg == "--tile-size")
+            aParam.TileSize = std::max(16,atoi(value.c_str()));
+        else if (arg == "--max-age")
+            aParam.MaxAge = std::max(0,atoi(value.c_str()));
+        else
+            return false;
+        }
+    return aParam.Port > 0 && aParam.Port < 65536;
+    }
+
+}
+
+int main(int argc,char** argv)
+    {
+    ServerParam param;
+    if (!ParseArguments(argc,argv,param))
+        {
+        std::cerr << "usage: unix_tile_server [--map FILE] [--style FILE] [--font FILE] [--port N] [--threads N] [--tile-size N] [--max-age SECONDS]\n";
+        return 2;
+        }
+
+    signal(SIGPIPE,SIG_IGN);
+    struct sigaction action = { };
+    action.sa_handler = Stop;
+    sigaction(SIGINT,&action,nullptr);
+    sigaction(SIGTERM,&action,nullptr);
+
+    Server server(param);
+    return server.Run();
+    }
@@ -7,5 +7,17 @@ See www.cartotype.com for more information.
 #pragma once
 
 #include <cartotype_framework.h>
+#include <cartotype_buffer_pool.h>
+#include <cartotype_elevation.h>
+#include <cartotype_flat_map_object.h>
+#include <cartotype_hash.h>
+#include <cartotype_map_journal.h>
+#include <cartotype_map_loader.h>
+#include <cartotype_profile.h>
+#include <cartotype_route_corridor.h>
+#include <cartotype_single_flight.h>
+#include <cartotype_terrain_cache.h>
+#include <cartotype_tour.h>
+#include <cartotype_traffic_feed.h>
 
 namespace CartoType = CartoTypeCore;
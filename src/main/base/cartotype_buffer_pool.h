@@ -0,0 +1,220 @@
+/*
+cartotype_buffer_pool.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_stream.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CartoTypeCore
+{
+
+class BufferPool;
+
+/**
+A byte buffer borrowed from a BufferPool, which is returned to the pool when the PooledBuffer is destroyed.
+A PooledBuffer can be moved but not copied. A buffer with no pool is simply freed.
+*/
+class PooledBuffer
+    {
+    public:
+    PooledBuffer() = default;
+    /** Creates a pooled buffer owning aBuffer, to be returned to aPool. */
+    PooledBuffer(std::vector<uint8_t>&& aBuffer,std::weak_ptr<BufferPool> aPool):
+        m_buffer(std::move(aBuffer)),
+        m_pool(std::move(aPool))
+        {
+        }
+    PooledBuffer(PooledBuffer&&) = default;
+    PooledBuffer& operator=(PooledBuffer&& aOther)
+        {
+        if (this != &aOther)
+            {
+            Release();
+            m_buffer = std::move(aOther.m_buffer);
+            m_pool = std::move(aOther.m_pool);
+            }
+        return *this;
+        }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer() { Release(); }
+
+    /** Returns the buffer, whose capacity may be larger than its size. */
+    std::vector<uint8_t>& Vector() { return m_buffer; }
+    /** Returns a pointer to the data. */
+    const uint8_t* Data() const { return m_buffer.data(); }
+    /** Returns the number of bytes of data. */
+    size_t Size() const { return m_buffer.size(); }
+    /** Returns true if there is no data. */
+    bool Empty() const { return m_buffer.empty(); }
+    /** Returns a pointer to the start of the data. */
+    const uint8_t* begin() const { return m_buffer.data(); }
+    /** Returns a pointer to the end of the data. */
+    const uint8_t* end() const { return m_buffer.data() + m_buffer.size(); }
+
+    private:
+    inline void Release();
+
+    std::vector<uint8_t> m_buffer;
+    std::weak_ptr<BufferPool> m_pool;
+    };
+
+/**
+A pool of byte buffers in power-of-two size classes, for reusing large buffers on hot paths
+such as encoding map tiles, where allocating a new buffer for every tile means page faults
+and contention in the memory allocator. Buffers are kept on a free list for each size class
+until the total size of the free buffers reaches a limit.
+
+A pool must be owned by a std::shared_ptr, so that buffers outliving it are freed instead of returned.
+*/
+class BufferPool: public std::enable_shared_from_this<BufferPool>
+    {
+    public:
+    /** Creates a pool keeping up to aMaxFreeBytes of free buffers. Use BufferPool::New. */
+    explicit BufferPool(size_t aMaxFreeBytes): m_max_free_bytes(aMaxFreeBytes) { }
+
+    /** Creates a pool keeping up to aMaxFreeBytes of free buffers. */
+    static std::shared_ptr<BufferPool> New(size_t aMaxFreeBytes = 64 * 1024 * 1024)
+        {
+        return std::make_shared<BufferPool>(aMaxFreeBytes);
+        }
+
+    /** Returns an empty buffer with a capacity of at least aCapacity bytes. */
+    PooledBuffer Acquire(size_t aCapacity)
+        {
+        size_t c = SizeClass(aCapacity);
+        std::vector<uint8_t> buffer;
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (c < m_free_list.size() && !m_free_list[c].empty())
+                {
+                buffer = std::move(m_free_list[c].back());
+                m_free_list[c].pop_back();
+                m_free_bytes -= buffer.capacity();
+                }
+            }
+        if (buffer.capacity())
+            m_hits++;
+        else
+            {
+            m_misses++;
+            buffer.reserve(KMinSize << c);
+            }
+        return PooledBuffer(std::move(buffer),weak_from_this());
+        }
+
+    /** Returns a buffer to the pool. It is freed if the pool is full or the buffer is too small or too large to be worth keeping. */
+    void Release(std::vector<uint8_t>&& aBuffer)
+        {
+        size_t capacity = aBuffer.capacity();
+        if (capacity < KMinSize)
+            return;
+        // Buffers go in the largest class they can satisfy, so that Acquire never returns one that is too small.
+        size_t c = SizeClass(capacity);
+        if ((KMinSize << c) > capacity)
+            c--;
+        if (c >= KSizeClassCount)
+            return;
+        aBuffer.clear();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free_bytes + capacity > m_max_free_bytes)
+            return;
+        if (m_free_list.size() <= c)
+            m_free_list.resize(c + 1);
+        m_free_list[c].push_back(std::move(aBuffer));
+        m_free_bytes += capacity;
+        }
+
+    /** Returns the total capacity of the free buffers. */
+    size_t FreeBytes() const
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_free_bytes;
+        }
+
+    /** Returns the number of requests satisfied by reusing a buffer. */
+    uint64_t Hits() const { return m_hits; }
+    /** Returns the number of requests which needed a new buffer. */
+    uint64_t Misses() const { return m_misses; }
+
+    private:
+    static constexpr size_t KMinSize = 4096;
+    static constexpr size_t KSizeClassCount = 15; // 4K to 64M
+
+    static size_t SizeClass(size_t aCapacity)
+        {
+        size_t c = 0;
+        while ((KMinSize << c) < aCapacity)
+            c++;
+        return c;
+        }
+
+    size_t m_max_free_bytes;
+    mutable std::mutex m_mutex;
+    std::vector<std::vector<std::vector<uint8_t>>> m_free_list;
+    size_t m_free_bytes = 0;
+    std::atomic<uint64_t> m_hits { 0 };
+    std::atomic<uint64_t> m_misses { 0 };
+    };
+
+inline void PooledBuffer::Release()
+    {
+    auto pool = m_pool.lock();
+    if (pool)
+        pool->Release(std::move(m_buffer));
+    m_buffer = std::vector<uint8_t>();
+    m_pool.reset();
+    }
+
+/**
+An output stream writing to buffers from a BufferPool: for example, to encode a tile as PNG
+without allocating and growing a new buffer for every tile.
+*/
+class PooledOutputStream: public OutputStream
+    {
+    public:
+    /** Creates a stream writing to a buffer from aPool with a capacity of at least aInitialCapacity bytes. */
+    PooledOutputStream(std::shared_ptr<BufferPool> aPool,size_t aInitialCapacity = 64 * 1024):
+        m_pool(aPool),
+        m_buffer(aPool->Acquire(aInitialCapacity))
+        {
+        }
+
+    void Write(const uint8_t* aBuffer,size_t aBytes) override
+        {
+        std::vector<uint8_t>& v = m_buffer.Vector();
+        if (v.size() + aBytes > v.capacity())
+            {
+            PooledBuffer bigger = m_pool->Acquire(std::max(v.capacity() * 2,v.size() + aBytes));
+            bigger.Vector().assign(v.begin(),v.end());
+            m_buffer = std::move(bigger);
+            }
+        m_buffer.Vector().insert(m_buffer.Vector().end(),aBuffer,aBuffer + aBytes);
+        }
+
+    /** Returns a pointer to the data written. */
+    const uint8_t* Data() const { return m_buffer.Data(); }
+    /** Returns the number of bytes written. */
+    size_t Length() const { return m_buffer.Size(); }
+    /** Takes ownership of the data; the stream is left empty. */
+    PooledBuffer TakeData()
+        {
+        PooledBuffer b = std::move(m_buffer);
+        m_buffer = PooledBuffer();
+        return b;
+        }
+
+    private:
+    std::shared_ptr<BufferPool> m_pool;
+    PooledBuffer m_buffer;
+    };
+
+} // namespace CartoTypeCore
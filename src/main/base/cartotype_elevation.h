@@ -0,0 +1,240 @@
+/*
+cartotype_elevation.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+namespace CartoTypeCore
+{
+
+/**
+Gets the heights of many points, as Framework::Heights does, but faster for large sets of points.
+
+The points are sorted along a Z-order curve and split into batches of nearby points. This is a
+locality heuristic: each batch covers a small area, so the terrain data it needs is likely to be
+shared by many of its points, and is likely to be cached while the batch is processed. How much it
+helps depends on the terrain data and the platform; unix_benchmark compares it with Framework::Heights.
+The batches are shared between several threads, each using a copy of aFramework; if aThreadCount is zero
+the number of hardware threads is used. The heights are returned in the order of the points.
+
+Sets of no more than one batch are passed directly to Framework::Heights. Heights which are unknown
+are returned as Framework::Heights reports them, whether or not the points are batched.
+Points which could not be processed because of an error are given the height INT16_MIN.
+*/
+inline std::vector<int32_t> BatchHeights(Result& aError,const Framework& aFramework,const CoordSet& aCoordSet,CoordType aCoordType,size_t aThreadCount = 0)
+    {
+    const size_t KBatchSize = 4096;
+    aError = KErrorNone;
+    size_t n = aCoordSet.Count();
+    if (n <= KBatchSize)
+        {
+        std::vector<int32_t> height = aFramework.Heights(aError,aCoordSet,aCoordType);
+        if (aError)
+            height.resize(n,INT16_MIN);
+        return height;
+        }
+
+    // Sort the points by Z-order.
+    double min_x = aCoordSet.X(0), max_x = min_x, min_y = aCoordSet.Y(0), max_y = min_y;
+    for (size_t i = 1; i < n; i++)
+        {
+        min_x = std::min(min_x,aCoordSet.X(i));
+        max_x = std::max(max_x,aCoordSet.X(i));
+        min_y = std::min(min_y,aCoordSet.Y(i));
+        max_y = std::max(max_y,aCoordSet.Y(i));
+        }
+    double sx = max_x > min_x ? 65535 / (max_x - min_x) : 0;
+    double sy = max_y > min_y ? 65535 / (max_y - min_y) : 0;
+    auto spread = [](uint32_t aValue)
+        {
+        aValue = (aValue | (aValue << 8)) & 0x00FF00FF;
+        aValue = (aValue | (aValue << 4)) & 0x0F0F0F0F;
+        aValue = (aValue | (aValue << 2)) & 0x33333333;
+        aValue = (aValue | (aValue << 1)) & 0x55555555;
+        return aValue;
+        };
+    std::vector<std::pair<uint32_t,uint32_t>> order(n);
+    for (size_t i = 0; i < n; i++)
+        {
+        uint32_t code = spread(uint32_t((aCoordSet.X(i) - min_x) * sx)) | (spread(uint32_t((aCoordSet.Y(i) - min_y) * sy)) << 1);
+        order[i] = { code, uint32_t(i) };
+        }
+    std::sort(order.begin(),order.end());
+
+    std::vector<int32_t> height(n,INT16_MIN);
+    size_t batch_count = (n + KBatchSize - 1) / KBatchSize;
+    if (!aThreadCount)
+        aThreadCount = std::max(1U,std::thread::hardware_concurrency());
+    aThreadCount = std::min(aThreadCount,batch_count);
+
+    std::atomic<size_t> next_batch { 0 };
+    std::vector<Result> error(aThreadCount);
+    auto run = [&](const Framework& aThreadFramework,size_t aThreadIndex)
+        {
+        std::vector<PointFP> point;
+        for (;;)
+            {
+            size_t batch = next_batch++;
+            if (batch >= batch_count || error[aThreadIndex])
+                return;
+            size_t start = batch * KBatchSize;
+            size_t end = std::min(start + KBatchSize,n);
+            point.clear();
+            for (size_t i = start; i < end; i++)
+                point.push_back(aCoordSet.Point(order[i].second));
+            std::vector<int32_t> h = aThreadFramework.Heights(error[aThreadIndex],CoordSet(point),aCoordType);
+            for (size_t i = start; i < end && i - start < h.size(); i++)
+                height[order[i].second] = h[i - start];
+            }
+        };
+
+    std::vector<std::thread> thread_array;
+    std::vector<std::unique_ptr<Framework>> framework_array;
+    for (size_t t = 1; t < aThreadCount; t++)
+        {
+        auto framework = aFramework.Copy(error[t],false,false);
+        if (error[t])
+            {
+            // Use the threads already started.
+            error[t] = KErrorNone;
+            break;
+            }
+        framework_array.push_back(std::move(framework));
+        thread_array.emplace_back(run,std::cref(*framework_array.back()),t);
+        }
+    run(aFramework,0);
+    for (auto& t : thread_array)
+        t.join();
+    for (auto e : error)
+        if (e)
+            {
+            aError = e;
+            break;
+            }
+    return height;
+    }
+
+/** The heights along a route, made by RouteElevationProfile. */
+class ElevationProfile
+    {
+    public:
+    /** The distances of the samples along the route in meters. */
+    std::vector<double> Distance;
+    /** The heights of the samples in meters. Unknown heights are interpolated from their neighbours; see RouteElevationProfile. */
+    std::vector<int32_t> Height;
+    /** The total ascent in meters, ignoring changes smaller than the threshold passed to RouteElevationProfile. */
+    double Ascent = 0;
+    /** The total descent in meters, ignoring changes smaller than the threshold passed to RouteElevationProfile. */
+    double Descent = 0;
+    };
+
+/**
+Creates an elevation profile for a route by sampling heights along Route::Path every aSpacingInMeters,
+using BatchHeights. The first and last points of the route are always sampled.
+Ascent and descent are accumulated only when the height has changed by at least aThresholdInMeters since the last
+turning point, so that noise in the terrain data does not inflate them.
+
+Heights at or below INT16_MIN are treated as unknown. This assumes that Framework::Heights reports unknown heights
+using the void value of 16-bit terrain data, which the library does not document.
+*/
+inline ElevationProfile RouteElevationProfile(Result& aError,const Framework& aFramework,const Route& aRoute,double aSpacingInMeters = 25,
+                                              double aThresholdInMeters = 3,size_t aThreadCount = 0)
+    {
+    aError = KErrorNone;
+    ElevationProfile profile;
+    const OnCurveContour& path = aRoute.Path;
+    if (path.Points() == 0 || aSpacingInMeters <= 0)
+        return profile;
+
+    // Sample the path in map units, using the route's own ratio of meters to map units to convert distances.
+    double path_length = 0;
+    for (size_t i = 1; i < path.Points(); i++)
+        path_length += std::hypot(double(path.Point(i).X) - path.Point(i - 1).X,double(path.Point(i).Y) - path.Point(i - 1).Y);
+    double meters_per_map_unit = path_length > 0 ? aRoute.Distance / path_length : 0;
+    double spacing = meters_per_map_unit > 0 ? aSpacingInMeters / meters_per_map_unit : path_length + 1;
+
+    std::vector<PointFP> sample;
+    sample.reserve(size_t(path_length / spacing) + 2);
+    sample.emplace_back(path.Point(0).X,path.Point(0).Y);
+    profile.Distance.push_back(0);
+    double distance = 0, next = spacing;
+    for (size_t i = 1; i < path.Points(); i++)
+        {
+        PointFP a(path.Point(i - 1).X,path.Point(i - 1).Y);
+        PointFP b(path.Point(i).X,path.Point(i).Y);
+        double length = std::hypot(b.X - a.X,b.Y - a.Y);
+        while (next < distance + length)
+            {
+            double f = (next - distance) / length;
+            sample.emplace_back(a.X + (b.X - a.X) * f,a.Y + (b.Y - a.Y) * f);
+            profile.Distance.push_back(next * meters_per_map_unit);
+            next += spacing;
+            }
+        distance += length;
+        }
+    if (path.Points() > 1)
+        {
+        sample.emplace_back(path.Point(path.Points() - 1).X,path.Point(path.Points() - 1).Y);
+        profile.Distance.push_back(aRoute.Distance);
+        }
+
+    profile.Height = BatchHeights(aError,aFramework,CoordSet(sample),CoordType::Map,aThreadCount);
+    if (aError)
+        return profile;
+
+    // Interpolate unknown heights; leave them unknown if there are no known heights at all.
+    size_t n = profile.Height.size();
+    size_t previous = SIZE_MAX;
+    for (size_t i = 0; i <= n; i++)
+        {
+        if (i < n && profile.Height[i] <= INT16_MIN)
+            continue;
+        size_t gap_start = previous == SIZE_MAX ? 0 : previous + 1;
+        for (size_t j = gap_start; j < i; j++)
+            {
+            if (previous == SIZE_MAX && i == n)
+                break;
+            if (previous == SIZE_MAX)
+                profile.Height[j] = profile.Height[i];
+            else if (i == n)
+                profile.Height[j] = profile.Height[previous];
+            else
+                {
+                double f = (profile.Distance[j] - profile.Distance[previous]) / std::max(1e-9,profile.Distance[i] - profile.Distance[previous]);
+                profile.Height[j] = int32_t(std::lround(profile.Height[previous] + (profile.Height[i] - profile.Height[previous]) * f));
+                }
+            }
+        previous = i;
+        }
+
+    // Accumulate ascent and descent with hysteresis.
+    if (n && profile.Height[0] > INT16_MIN)
+        {
+        int32_t reference = profile.Height[0];
+        for (size_t i = 1; i < n; i++)
+            {
+            int32_t d = profile.Height[i] - reference;
+            if (d >= aThresholdInMeters)
+                {
+                profile.Ascent += d;
+                reference = profile.Height[i];
+                }
+            else if (-d >= aThresholdInMeters)
+                {
+                profile.Descent -= d;
+                reference = profile.Height[i];
+                }
+            }
+        }
+    return profile;
+    }
+
+} // namespace CartoTypeCore
@@ -0,0 +1,323 @@
+/*
+cartotype_flat_map_object.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_map_object.h>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace CartoTypeCore
+{
+
+/**
+A flat, relocatable binary layout for arrays of map objects.
+
+The layout contains no pointers, so a buffer can be written to a file, memory-mapped,
+or passed between processes through shared memory, and read in place using FlatMapObjectArray
+without any deserialization. Points are stored as OutlinePoint objects and strings as UTF-16,
+so the reader's ContourView and Text objects point directly into the buffer.
+
+The layout uses the native byte order and structure sizes, which are recorded in the header
+and checked when a buffer is opened; it is intended for exchange between processes on the same
+machine, not as a storage format. Use Framework::SaveMap for that.
+
+All sections are aligned to 8 bytes:
+header; object offsets (uint64_t); layer offsets (uint64_t); layer names; objects.
+*/
+namespace FlatMapObject
+    {
+    /** The value of the first four bytes of a flat map object buffer: 'CTFO' in the native byte order. */
+    constexpr uint32_t KMagic = 0x4F465443;
+    /** The version of the layout. */
+    constexpr uint32_t KVersion = 1;
+
+    /** The header at the start of a buffer. */
+    class Header
+        {
+        public:
+        uint32_t Magic = KMagic;
+        uint32_t Version = KVersion;
+        uint32_t OutlinePointSize = uint32_t(sizeof(OutlinePoint));
+        uint32_t ObjectCount = 0;
+        uint32_t LayerCount = 0;
+        uint32_t Reserved = 0;
+        uint64_t Size = 0;
+        };
+
+    /** The fixed-size part of a stored map object, which is followed by its contours, points and string attributes. */
+    class ObjectHeader
+        {
+        public:
+        uint64_t Id = 0;
+        int64_t UserData = 0;
+        uint32_t FeatureInfo = 0;
+        uint32_t Layer = 0;
+        uint32_t ContourCount = 0;
+        uint32_t PointCount = 0;
+        uint32_t StringLength = 0;
+        uint32_t LabelLength = 0;
+        uint16_t Type = 0;
+        uint16_t MayHaveCurves = 0;
+        uint32_t Reserved = 0;
+        };
+
+    /** A stored contour: a range of points in the object's point array. */
+    class ContourRange
+        {
+        public:
+        uint32_t Start = 0;
+        uint32_t Count = 0;
+        uint32_t Closed = 0;
+        uint32_t Reserved = 0;
+        };
+
+    /** Rounds a size up to a multiple of 8. */
+    inline size_t Aligned(size_t aSize) { return (aSize + 7) & ~size_t(7); }
+    }
+
+/**
+Writes an array of map objects to a flat buffer which can be read in place by FlatMapObjectArray.
+The buffer is replaced, not appended to.
+
+Objects of type MapObjectType::Array (images and height data) cannot be stored, because their
+data is not held in their contours; if there are any, KErrorUnimplemented is returned and the buffer is left empty.
+*/
+inline Result WriteFlatMapObjects(const MapObjectArray& aMapObjectArray,std::vector<uint8_t>& aBuffer)
+    {
+    using namespace FlatMapObject;
+    aBuffer.clear();
+    for (const auto& object : aMapObjectArray)
+        if (object->Type() == MapObjectType::Array)
+            return KErrorUnimplemented;
+
+    // Collect the distinct layer names.
+    std::vector<const MString*> layer_array;
+    std::map<String,uint32_t> layer_index;
+    std::vector<uint32_t> object_layer(aMapObjectArray.size());
+    for (size_t i = 0; i < aMapObjectArray.size(); i++)
+        {
+        String layer(aMapObjectArray[i]->LayerName());
+        auto p = layer_index.find(layer);
+        if (p == layer_index.end())
+            {
+            p = layer_index.emplace(layer,uint32_t(layer_array.size())).first;
+            layer_array.push_back(&aMapObjectArray[i]->LayerName());
+            }
+        object_layer[i] = p->second;
+        }
+
+    size_t pos = Aligned(sizeof(Header));
+    size_t object_offset_pos = pos;
+    pos += Aligned(aMapObjectArray.size() * sizeof(uint64_t));
+    size_t layer_offset_pos = pos;
+    pos += Aligned(layer_array.size() * sizeof(uint64_t));
+    aBuffer.resize(pos);
+
+    auto append = [&aBuffer](const void* aData,size_t aSize)
+        {
+        size_t start = aBuffer.size();
+        aBuffer.resize(start + Aligned(aSize));
+        if (aSize)
+            memcpy(aBuffer.data() + start,aData,aSize);
+        return uint64_t(start);
+        };
+
+    for (size_t i = 0; i < layer_array.size(); i++)
+        {
+        uint64_t offset = aBuffer.size();
+        uint32_t length = uint32_t(layer_array[i]->Length());
+        aBuffer.resize(offset + Aligned(sizeof(uint32_t) + length * sizeof(uint16_t)));
+        memcpy(aBuffer.data() + offset,&length,sizeof(length));
+        if (length)
+            memcpy(aBuffer.data() + offset + sizeof(uint32_t),layer_array[i]->Data(),length * sizeof(uint16_t));
+        memcpy(aBuffer.data() + layer_offset_pos + i * sizeof(uint64_t),&offset,sizeof(offset));
+        }
+
+    std::vector<ContourRange> contour_array;
+    std::vector<OutlinePoint> point_array;
+    for (size_t i = 0; i < aMapObjectArray.size(); i++)
+        {
+        const MapObject& object = *aMapObjectArray[i];
+        contour_array.clear();
+        point_array.clear();
+        for (size_t j = 0; j < object.Contours(); j++)
+            {
+            ContourView contour = object.ContourByIndex(j);
+            ContourRange c;
+            c.Start = uint32_t(point_array.size());
+            c.Count = uint32_t(contour.Points());
+            c.Closed = contour.Closed();
+            contour_array.push_back(c);
+            for (size_t k = 0; k < contour.Points(); k++)
+                point_array.push_back(contour.Point(k));
+            }
+
+        Text string_attributes = object.StringAttributes();
+        ObjectHeader h;
+        h.Id = object.Id();
+        h.UserData = object.UserData();
+        h.FeatureInfo = object.FeatureInfo().RawValue();
+        h.Layer = object_layer[i];
+        h.ContourCount = uint32_t(contour_array.size());
+        h.PointCount = uint32_t(point_array.size());
+        h.StringLength = uint32_t(string_attributes.Length());
+        h.LabelLength = uint32_t(object.Label().Length());
+        h.Type = uint16_t(object.Type());
+        h.MayHaveCurves = object.MayHaveCurves();
+
+        uint64_t offset = append(&h,sizeof(h));
+        append(contour_array.data(),contour_array.size() * sizeof(ContourRange));
+        append(point_array.data(),point_array.size() * sizeof(OutlinePoint));
+        append(string_attributes.Data(),string_attributes.Length() * sizeof(uint16_t));
+        memcpy(aBuffer.data() + object_offset_pos + i * sizeof(uint64_t),&offset,sizeof(offset));
+        }
+
+    Header header;
+    header.ObjectCount = uint32_t(aMapObjectArray.size());
+    header.LayerCount = uint32_t(layer_array.size());
+    header.Size = aBuffer.size();
+    memcpy(aBuffer.data(),&header,sizeof(header));
+    return KErrorNone;
+    }
+
+/**
+A read-only map object whose data is stored in a flat buffer written by WriteFlatMapObjects.
+Contours and string attributes refer directly to the buffer, which must outlive the object.
+The object cannot be modified: WritableContour returns an empty contour, and Normalize and Simplify do nothing.
+*/
+class FlatMapObjectView: public MapObject
+    {
+    public:
+    /** Creates a view of the stored object aHeader, using a layer name shared by all objects in the same layer. */
+    FlatMapObjectView(const FlatMapObject::ObjectHeader* aHeader,RefCountedString aLayer):
+        MapObject(aLayer,MapObjectType(aHeader->Type)),
+        m_header(aHeader)
+        {
+        iId = aHeader->Id;
+        iFeatureInfo = CartoTypeCore::FeatureInfo::FromRawValue(aHeader->FeatureInfo);
+        iUserData.Int = aHeader->UserData;
+        }
+
+    size_t Contours() const override { return m_header->ContourCount; }
+    ContourView ContourByIndex(size_t aIndex) const override
+        {
+        const FlatMapObject::ContourRange& c = ContourArray()[aIndex];
+        return ContourView(PointArray() + c.Start,c.Count,c.Closed != 0);
+        }
+    bool MayHaveCurves() const override { return m_header->MayHaveCurves != 0; }
+    Text StringAttributes() const override { return Text(StringData(),m_header->StringLength); }
+    Text Label() const override { return Text(StringData(),m_header->LabelLength); }
+    WritableContourView WritableContour(size_t /*aIndex*/) override { return WritableContourView(nullptr,0,false); }
+    void Normalize() override { }
+    void Simplify(int32_t /*aResolution*/) override { }
+
+    private:
+    const uint8_t* Data() const { return reinterpret_cast<const uint8_t*>(m_header); }
+    const FlatMapObject::ContourRange* ContourArray() const
+        {
+        return reinterpret_cast<const FlatMapObject::ContourRange*>(Data() + FlatMapObject::Aligned(sizeof(FlatMapObject::ObjectHeader)));
+        }
+    const OutlinePoint* PointArray() const
+        {
+        return reinterpret_cast<const OutlinePoint*>(reinterpret_cast<const uint8_t*>(ContourArray()) +
+                                                     FlatMapObject::Aligned(m_header->ContourCount * sizeof(FlatMapObject::ContourRange)));
+        }
+    const uint16_t* StringData() const
+        {
+        return reinterpret_cast<const uint16_t*>(reinterpret_cast<const uint8_t*>(PointArray()) +
+                                                 FlatMapObject::Aligned(m_header->PointCount * sizeof(OutlinePoint)));
+        }
+
+    const FlatMapObject::ObjectHeader* m_header;
+    };
+
+/**
+An array of map objects read in place from a flat buffer written by WriteFlatMapObjects.
+The buffer is not copied and must remain valid, and unchanged, while the array is in use.
+It may be memory-mapped or in shared memory, but must be aligned to 8 bytes.
+*/
+class FlatMapObjectArray
+    {
+    public:
+    /**
+    Opens a flat buffer, checking its header and the bounds of all its objects.
+    Returns KErrorCorrupt if the buffer is malformed, or KErrorUnknownVersion if it was written
+    by a different version or on a platform with a different byte order or structure layout.
+    */
+    Result Open(const uint8_t* aData,size_t aSize)
+        {
+        using namespace FlatMapObject;
+        m_object_array.clear();
+        if (!aData || (uintptr_t(aData) & 7) || aSize < sizeof(Header))
+            return KErrorCorrupt;
+        const Header* h = reinterpret_cast<const Header*>(aData);
+        if (h->Magic != KMagic || h->Version != KVersion || h->OutlinePointSize != sizeof(OutlinePoint))
+            return KErrorUnknownVersion;
+        if (h->Size > aSize)
+            return KErrorCorrupt;
+        aSize = size_t(h->Size);
+
+        size_t object_offset_pos = Aligned(sizeof(Header));
+        size_t layer_offset_pos = object_offset_pos + Aligned(size_t(h->ObjectCount) * sizeof(uint64_t));
+        if (layer_offset_pos + size_t(h->LayerCount) * sizeof(uint64_t) > aSize)
+            return KErrorCorrupt;
+        const uint64_t* object_offset = reinterpret_cast<const uint64_t*>(aData + object_offset_pos);
+        const uint64_t* layer_offset = reinterpret_cast<const uint64_t*>(aData + layer_offset_pos);
+
+        std::vector<RefCountedString> layer_array;
+        for (uint32_t i = 0; i < h->LayerCount; i++)
+            {
+            uint64_t p = layer_offset[i];
+            if ((p & 7) || p + sizeof(uint32_t) > aSize)
+                return KErrorCorrupt;
+            uint32_t length = *reinterpret_cast<const uint32_t*>(aData + p);
+            if (p + sizeof(uint32_t) + uint64_t(length) * sizeof(uint16_t) > aSize)
+                return KErrorCorrupt;
+            layer_array.emplace_back(Text(reinterpret_cast<const uint16_t*>(aData + p + sizeof(uint32_t)),length));
+            }
+
+        std::vector<FlatMapObjectView> object_array;
+        object_array.reserve(h->ObjectCount);
+        for (uint32_t i = 0; i < h->ObjectCount; i++)
+            {
+            uint64_t p = object_offset[i];
+            if ((p & 7) || p + sizeof(ObjectHeader) > aSize)
+                return KErrorCorrupt;
+            const ObjectHeader* oh = reinterpret_cast<const ObjectHeader*>(aData + p);
+            uint64_t end = p + Aligned(sizeof(ObjectHeader)) + Aligned(uint64_t(oh->ContourCount) * sizeof(ContourRange)) +
+                           Aligned(uint64_t(oh->PointCount) * sizeof(OutlinePoint)) + uint64_t(oh->StringLength) * sizeof(uint16_t);
+            if (end > aSize || oh->Layer >= h->LayerCount || oh->LabelLength > oh->StringLength ||
+                oh->Type >= uint16_t(MapObjectType::Array))
+                return KErrorCorrupt;
+            const ContourRange* contour = reinterpret_cast<const ContourRange*>(aData + p + Aligned(sizeof(ObjectHeader)));
+            for (uint32_t j = 0; j < oh->ContourCount; j++)
+                if (uint64_t(contour[j].Start) + contour[j].Count > oh->PointCount)
+                    return KErrorCorrupt;
+            object_array.emplace_back(oh,layer_array[oh->Layer]);
+            }
+        m_object_array = std::move(object_array);
+        return KErrorNone;
+        }
+
+    /** Opens a flat buffer held in a vector. */
+    Result Open(const std::vector<uint8_t>& aBuffer) { return Open(aBuffer.data(),aBuffer.size()); }
+
+    /** Returns the number of objects. */
+    size_t Size() const { return m_object_array.size(); }
+    /** Returns the object indexed by aIndex. */
+    const MapObject& operator[](size_t aIndex) const { return m_object_array[aIndex]; }
+    /** Returns an iterator to the start of the objects. */
+    std::vector<FlatMapObjectView>::const_iterator begin() const { return m_object_array.begin(); }
+    /** Returns an iterator to the end of the objects. */
+    std::vector<FlatMapObjectView>::const_iterator end() const { return m_object_array.end(); }
+
+    private:
+    std::vector<FlatMapObjectView> m_object_array;
+    };
+
+} // namespace CartoTypeCore
@@ -352,10 +352,14 @@ class Framework: public MNavigatorObserver
         The number of levels of the text index to load into memory.
         Use values from 2 to 5 to make text searches faster, at the cost of using more RAM.
         The value 0 causes the default number of levels (3) to be loaded, allowing fast text searching without using too much RAM.
-        The value -1 disables text index loading.
+        The value -1 disables text index loading, so that the text index is not read at startup.
         */
         int32_t TextIndexLevels = 0;
-        /** If non-null, the framework will use this shared engine and not MapFileName or FontFileName. */
+        /**
+        If non-null, the framework will use this shared engine and not MapFileName or FontFileName.
+        Creating frameworks from a shared engine and map data set is much faster than loading them again,
+        because fonts are not reloaded and the map is not reopened.
+        */
         std::shared_ptr<FrameworkEngine> SharedEngine;
         /** If non-null, the framework will use this shared dataset and not MapFileName or FontFileName. */
         std::shared_ptr<FrameworkMapDataSet> SharedMapDataSet;
@@ -0,0 +1,300 @@
+/*
+cartotype_hash.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// The CRC32C instruction is used where the compiler can target it; otherwise a slice-by-8 table is used.
+#if !defined(CARTOTYPE_NO_HARDWARE_CRC)
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        #include <nmmintrin.h>
+        #define CARTOTYPE_CRC32C_SSE42
+    #elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        #include <intrin.h>
+        #include <nmmintrin.h>
+        #define CARTOTYPE_CRC32C_SSE42
+    #elif defined(__ARM_FEATURE_CRC32)
+        #include <arm_acle.h>
+        #define CARTOTYPE_CRC32C_ARM
+    #endif
+#endif
+
+namespace CartoTypeCore
+{
+
+/**
+A class to create CRC32C (Castagnoli) checksums, with the same interface as CRCGenerator.
+
+CRCGenerator uses a different polynomial, so the two cannot be mixed; CRC32C is the polynomial
+supported by the SSE4.2 and ARMv8 CRC instructions, which this class uses if the processor has them,
+giving checksums of many gigabytes per second. Otherwise the checksum is computed eight bytes at a time
+using slice-by-8 tables, which is several times faster than the usual byte-at-a-time method.
+*/
+class CRC32CGenerator
+    {
+    public:
+    /**
+    Generates a CRC from a block of data using a specified start value, which may be the CRC of a previous block.
+    Use a start value of zero for the first block. The result is the standard CRC32C: for example, the CRC of
+    the ASCII string "123456789" is 0xE3069283.
+    */
+    uint32_t Generate(uint32_t aStartValue,const uint8_t* aData,size_t aLength) const
+        {
+        uint32_t crc = ~aStartValue;
+#if defined(CARTOTYPE_CRC32C_SSE42)
+        if (HaveSse42())
+            return ~GenerateSse42(crc,aData,aLength);
+#elif defined(CARTOTYPE_CRC32C_ARM)
+        return ~GenerateArm(crc,aData,aLength);
+#endif
+        return ~GenerateTable(crc,aData,aLength);
+        }
+
+    /** Returns true if a hardware CRC32C instruction is used. */
+    static bool HardwareAccelerated()
+        {
+#if defined(CARTOTYPE_CRC32C_SSE42)
+        return HaveSse42();
+#elif defined(CARTOTYPE_CRC32C_ARM)
+        return true;
+#else
+        return false;
+#endif
+        }
+
+    private:
+    using TableArray = std::array<std::array<uint32_t,256>,8>;
+
+    static const TableArray& Table()
+        {
+        static const TableArray table = []()
+            {
+            TableArray t;
+            for (uint32_t i = 0; i < 256; i++)
+                {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+                t[0][i] = c;
+                }
+            for (uint32_t i = 0; i < 256; i++)
+                for (size_t s = 1; s < 8; s++)
+                    t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            return t;
+            }();
+        return table;
+        }
+
+    static uint32_t GenerateTable(uint32_t aCrc,const uint8_t* aData,size_t aLength)
+        {
+        const TableArray& t = Table();
+        while (aLength >= 8)
+            {
+            uint32_t lo, hi;
+            memcpy(&lo,aData,4);
+            memcpy(&hi,aData + 4,4);
+            lo = LittleEndian(lo) ^ aCrc;
+            hi = LittleEndian(hi);
+            aCrc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                   t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+            aData += 8;
+            aLength -= 8;
+            }
+        while (aLength--)
+            aCrc = (aCrc >> 8) ^ t[0][(aCrc ^ *aData++) & 0xFF];
+        return aCrc;
+        }
+
+    static uint32_t LittleEndian(uint32_t aValue)
+        {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return __builtin_bswap32(aValue);
+#else
+        return aValue;
+#endif
+        }
+
+#if defined(CARTOTYPE_CRC32C_SSE42)
+    static bool HaveSse42()
+        {
+#if defined(_MSC_VER)
+        static const bool have = []() { int info[4]; __cpuid(info,1); return (info[2] & (1 << 20)) != 0; }();
+        return have;
+#else
+        static const bool have = __builtin_cpu_supports("sse4.2");
+        return have;
+#endif
+        }
+
+#if defined(__GNUC__)
+    __attribute__((target("sse4.2")))
+#endif
+    static uint32_t GenerateSse42(uint32_t aCrc,const uint8_t* aData,size_t aLength)
+        {
+#if defined(__x86_64__) || defined(_M_X64)
+        uint64_t crc = aCrc;
+        while (aLength >= 8)
+            {
+            uint64_t v;
+            memcpy(&v,aData,8);
+            crc = _mm_crc32_u64(crc,v);
+            aData += 8;
+            aLength -= 8;
+            }
+        aCrc = uint32_t(crc);
+#endif
+        while (aLength >= 4)
+            {
+            uint32_t v;
+            memcpy(&v,aData,4);
+            aCrc = _mm_crc32_u32(aCrc,v);
+            aData += 4;
+            aLength -= 4;
+            }
+        while (aLength--)
+            aCrc = _mm_crc32_u8(aCrc,*aData++);
+        return aCrc;
+        }
+#endif
+
+#if defined(CARTOTYPE_CRC32C_ARM)
+    static uint32_t GenerateArm(uint32_t aCrc,const uint8_t* aData,size_t aLength)
+        {
+        while (aLength >= 8)
+            {
+            uint64_t v;
+            memcpy(&v,aData,8);
+            aCrc = __crc32cd(aCrc,v);
+            aData += 8;
+            aLength -= 8;
+            }
+        while (aLength--)
+            aCrc = __crc32cb(aCrc,*aData++);
+        return aCrc;
+        }
+#endif
+    };
+
+/**
+Returns the CRC32C of a file, reading it in large blocks: for example, to check map files after deployment.
+Returns false if the file cannot be opened or read.
+*/
+inline bool FileCRC32C(const char* aFileName,uint32_t& aCrc)
+    {
+    aCrc = 0;
+    FILE* file = fopen(aFileName,"rb");
+    if (!file)
+        return false;
+    CRC32CGenerator generator;
+    std::vector<uint8_t> buffer(1 << 20);
+    size_t n;
+    while ((n = fread(buffer.data(),1,buffer.size(),file)) > 0)
+        aCrc = generator.Generate(aCrc,buffer.data(),n);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+    }
+
+/**
+Returns a fast 64-bit non-cryptographic hash of a block of data, using the XXH64 algorithm,
+for making cache keys. Different seeds give independent hashes.
+*/
+inline uint64_t Hash64(const void* aData,size_t aLength,uint64_t aSeed = 0)
+    {
+    const uint64_t p1 = 0x9E3779B185EBCA87, p2 = 0xC2B2AE3D27D4EB4F, p3 = 0x165667B19E3779F9, p4 = 0x85EBCA77C2B2AE63, p5 = 0x27D4EB2F165667C5;
+    auto rotl = [](uint64_t aX,int aR) { return (aX << aR) | (aX >> (64 - aR)); };
+    auto read64 = [](const uint8_t* aP) { uint64_t v; memcpy(&v,aP,8); return v; };
+    auto read32 = [](const uint8_t* aP) { uint32_t v; memcpy(&v,aP,4); return v; };
+    auto round = [&](uint64_t aAcc,uint64_t aInput) { return rotl(aAcc + aInput * p2,31) * p1; };
+    auto merge = [&](uint64_t aAcc,uint64_t aValue) { return (aAcc ^ round(0,aValue)) * p1 + p4; };
+
+    const uint8_t* p = static_cast<const uint8_t*>(aData);
+    const uint8_t* end = p + aLength;
+    uint64_t h;
+    if (aLength >= 32)
+        {
+        uint64_t v1 = aSeed + p1 + p2, v2 = aSeed + p2, v3 = aSeed, v4 = aSeed - p1;
+        const uint8_t* limit = end - 32;
+        do
+            {
+            v1 = round(v1,read64(p));
+            v2 = round(v2,read64(p + 8));
+            v3 = round(v3,read64(p + 16));
+            v4 = round(v4,read64(p + 24));
+            p += 32;
+            }
+        while (p <= limit);
+        h = rotl(v1,1) + rotl(v2,7) + rotl(v3,12) + rotl(v4,18);
+        h = merge(h,v1);
+        h = merge(h,v2);
+        h = merge(h,v3);
+        h = merge(h,v4);
+        }
+    else
+        h = aSeed + p5;
+
+    h += aLength;
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ round(0,read64(p)),27) * p1 + p4;
+    if (p + 4 <= end)
+        {
+        h = rotl(h ^ (read32(p) * p1),23) * p2 + p3;
+        p += 4;
+        }
+    for (; p < end; p++)
+        h = rotl(h ^ (*p * p5),11) * p1;
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+    }
+
+/** Returns the 64-bit hash of a string. */
+inline uint64_t Hash64(const std::string& aText,uint64_t aSeed = 0)
+    {
+    return Hash64(aText.data(),aText.size(),aSeed);
+    }
+
+/**
+Builds a 64-bit hash from a sequence of values, for cache keys made of several parts,
+such as a style sheet, a tile's coordinates and drawing parameters. The hash depends on the
+order of the parts and on the boundaries between them.
+*/
+class Hasher64
+    {
+    public:
+    /** Adds a block of data. */
+    Hasher64& Add(const void* aData,size_t aLength)
+        {
+        m_hash = Hash64(aData,aLength,m_hash + aLength);
+        return *this;
+        }
+    /** Adds a string. */
+    Hasher64& Add(const std::string& aText) { return Add(aText.data(),aText.size()); }
+    /** Adds a number or other trivially copyable value. */
+    template<class T> Hasher64& AddValue(const T& aValue)
+        {
+        static_assert(std::is_trivially_copyable<T>::value,"AddValue requires a trivially copyable type");
+        return Add(&aValue,sizeof(aValue));
+        }
+    /** Returns the hash. */
+    uint64_t Value() const { return m_hash; }
+
+    private:
+    uint64_t m_hash = 0;
+    };
+
+} // namespace CartoTypeCore
@@ -0,0 +1,515 @@
+/*
+cartotype_map_journal.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace CartoTypeCore
+{
+
+/**
+A write-ahead journal for a writable map, making saves proportional to the size of a change
+rather than the size of the map.
+
+The map is stored as a base file, containing a snapshot made by Framework::SaveMap, and a journal
+file with the suffix ".journal", to which each insertion and deletion made through the MapJournal
+is appended as a small checksummed record. Open loads the base file and replays the journal.
+Any incomplete record at the end of the journal, left by a crash during a write, is discarded.
+
+Compact rewrites the base file. The snapshot is taken on the calling thread, because a Framework
+must not be used by more than one thread at once, but it is written to disk on a background thread.
+Records added meanwhile go to a fresh journal. Insertions are journaled with their identifiers and
+replayed with replacement, so replaying a journal that has already been compacted into the base file
+gives the same result; a crash at any point during compaction loses nothing that has been synced.
+*/
+class MapJournal
+    {
+    public:
+    /** Creates a journal for the writable map aMapHandle in aFramework, stored in the file aBaseFileName and its journal. */
+    MapJournal(Framework& aFramework,uint32_t aMapHandle,const std::string& aBaseFileName):
+        m_framework(aFramework),
+        m_map_handle(aMapHandle),
+        m_base_file_name(aBaseFileName),
+        m_journal_file_name(aBaseFileName + ".journal"),
+        m_old_journal_file_name(aBaseFileName + ".journal.old")
+        {
+        }
+
+    ~MapJournal()
+        {
+        WaitForCompaction();
+        if (m_journal)
+            fclose(m_journal);
+        }
+
+    MapJournal(const MapJournal&) = delete;
+    MapJournal(MapJournal&&) = delete;
+    void operator=(const MapJournal&) = delete;
+    void operator=(MapJournal&&) = delete;
+
+    /**
+    Loads the base file, if it exists, into the map, replays the journals and opens the journal for appending.
+    The map should be empty when this function is called.
+    */
+    Result Open()
+        {
+        std::error_code ec;
+        if (std::filesystem::exists(m_base_file_name,ec))
+            {
+            std::vector<uint8_t> data;
+            Result error = ReadFile(m_base_file_name,data);
+            if (!error)
+                error = m_framework.ReadMap(m_map_handle,data);
+            if (error)
+                return error;
+            }
+        Result error = Replay(m_old_journal_file_name,true);
+        if (!error)
+            error = Replay(m_journal_file_name,true);
+        if (error)
+            return error;
+        m_journal = fopen(m_journal_file_name.c_str(),"ab");
+        if (!m_journal)
+            return KErrorIo;
+        m_journal_size = uint64_t(std::filesystem::file_size(m_journal_file_name,ec));
+        return KErrorNone;
+        }
+
+    /**
+    Inserts a map object using Framework::InsertMapObject and appends a record of the insertion to the journal.
+    Display coordinates are converted to map coordinates first, so that replaying the journal does not depend on the view.
+    */
+    Result InsertMapObject(const String& aLayerName,const Geometry& aGeometry,const String& aStringAttributes,FeatureInfo aFeatureInfo,uint64_t& aId,bool aReplace)
+        {
+        Geometry geometry(aGeometry);
+        if (geometry.CoordType() == CoordType::Display)
+            {
+            Result error = m_framework.ConvertCoords(geometry,CoordType::Map);
+            if (error)
+                return error;
+            }
+        Result error = m_framework.InsertMapObject(m_map_handle,aLayerName,geometry,aStringAttributes,aFeatureInfo,aId,aReplace);
+        if (error)
+            return error;
+        std::vector<uint8_t> r;
+        Append(r,uint8_t(KInsertRecord));
+        Append(r,aId);
+        Append(r,aFeatureInfo.RawValue());
+        Append(r,uint8_t(geometry.CoordType()));
+        Append(r,uint8_t(geometry.IsClosed()));
+        Append(r,aLayerName);
+        Append(r,aStringAttributes);
+        Append(r,uint32_t(geometry.ContourCount()));
+        for (size_t i = 0; i < geometry.ContourCount(); i++)
+            {
+            size_t n = geometry.PointCount(i);
+            Append(r,uint32_t(n));
+            for (size_t j = 0; j < n; j++)
+                {
+                const OutlinePointFP& p = geometry.Point(i,j);
+                Append(r,p.X);
+                Append(r,p.Y);
+                Append(r,uint8_t(p.Type));
+                }
+            }
+        return Write(r);
+        }
+
+    /** Deletes map objects using Framework::DeleteMapObjects and appends a record of the deletion to the journal. */
+    Result DeleteMapObjects(uint64_t aStartId,uint64_t aEndId,uint64_t& aDeletedCount,String aCondition = nullptr)
+        {
+        Result error = m_framework.DeleteMapObjects(m_map_handle,aStartId,aEndId,aDeletedCount,aCondition);
+        if (error || !aDeletedCount)
+            return error;
+        std::vector<uint8_t> r;
+        Append(r,uint8_t(KDeleteRecord));
+        Append(r,aStartId);
+        Append(r,aEndId);
+        Append(r,aCondition);
+        return Write(r);
+        }
+
+    /** Forces all journal records to be written to permanent storage. */
+    Result Sync()
+        {
+        if (!m_journal)
+            return KErrorIo;
+        return SyncFile(m_journal) ? KErrorNone : KErrorIo;
+        }
+
+    /**
+    Takes a snapshot of the map, starts a new journal, and writes the snapshot to the base file
+    on a background thread. Waits for any previous compaction to finish first; if it failed, its error
+    is kept for WaitForCompaction, and its records are kept in the old journal, so starting again is safe.
+    */
+    Result Compact()
+        {
+        if (m_compaction_thread.joinable())
+            m_compaction_thread.join();
+
+        auto snapshot = std::make_shared<std::vector<uint8_t>>();
+        FindParam find_param;
+        find_param.TimeOut = 0;
+        Result error = m_framework.SaveMap(m_map_handle,*snapshot,find_param);
+        if (!error)
+            error = Sync();
+        if (error)
+            return error;
+
+        // Keep the current journal until the new base file is safely in place.
+        // If an earlier compaction failed, its old journal is still needed, so add to it,
+        // removing any incomplete record at its end first so that the added records can be replayed.
+        // The old journal is synced before the current one is truncated.
+        // If anything fails, the current journal is left open, or reopened, so that later changes are still journaled.
+        std::error_code ec;
+        bool directory_synced = true;
+        if (std::filesystem::exists(m_old_journal_file_name,ec))
+            {
+            std::vector<uint8_t> data, old_data;
+            error = ReadFile(m_journal_file_name,data);
+            if (!error)
+                error = ReadFile(m_old_journal_file_name,old_data);
+            if (error)
+                return error;
+            size_t old_size = ValidLength(old_data);
+            if (old_size < old_data.size())
+                {
+                std::filesystem::resize_file(m_old_journal_file_name,old_size,ec);
+                if (ec)
+                    return KErrorIo;
+                }
+            FILE* old_journal = fopen(m_old_journal_file_name.c_str(),"ab");
+            if (!old_journal)
+                return KErrorIo;
+            bool ok = (data.empty() || fwrite(data.data(),data.size(),1,old_journal) == 1) && SyncFile(old_journal);
+            ok = !fclose(old_journal) && ok;
+            if (!ok)
+                return KErrorIo;
+            fclose(m_journal);
+            }
+        else
+            {
+            // Windows cannot rename an open file, so the journal is closed first.
+            fclose(m_journal);
+            m_journal = nullptr;
+            std::filesystem::rename(m_journal_file_name,m_old_journal_file_name,ec);
+            if (ec)
+                return ReopenJournal(KErrorIo);
+            directory_synced = SyncDirectory(m_journal_file_name);
+            }
+        m_journal = fopen(m_journal_file_name.c_str(),"wb");
+        if (!m_journal)
+            return ReopenJournal(KErrorIo);
+        m_journal_size = 0;
+        if (!directory_synced)
+            return KErrorIo;
+
+        m_compaction_thread = std::thread([this,snapshot]()
+            {
+            Result e = WriteBaseFile(*snapshot);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (e)
+                m_compaction_error = e;
+            });
+        return KErrorNone;
+        }
+
+    /**
+    Waits for any compaction in progress to finish and returns its result, or the error from an automatic compaction
+    which failed to start. The error is cleared when it has been returned.
+    */
+    Result WaitForCompaction()
+        {
+        if (m_compaction_thread.joinable())
+            m_compaction_thread.join();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Result e = m_compaction_error;
+        m_compaction_error = KErrorNone;
+        return e;
+        }
+
+    /** Returns the number of bytes in the current journal. */
+    uint64_t JournalSize() const { return m_journal_size; }
+    /**
+    Sets the journal size in bytes above which insertions and deletions start a compaction automatically.
+    Zero, the default, disables automatic compaction. Errors from automatic compactions do not affect the
+    result of the insertion or deletion; they are returned by WaitForCompaction.
+    */
+    void SetCompactionThreshold(uint64_t aBytes) { m_compaction_threshold = aBytes; }
+
+    private:
+    static constexpr uint8_t KInsertRecord = 1;
+    static constexpr uint8_t KDeleteRecord = 2;
+
+    template<class T> static void Append(std::vector<uint8_t>& aRecord,T aValue)
+        {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&aValue);
+        aRecord.insert(aRecord.end(),p,p + sizeof(T));
+        }
+    static void Append(std::vector<uint8_t>& aRecord,const MString& aText)
+        {
+        Append(aRecord,uint32_t(aText.Length()));
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(aText.Data());
+        aRecord.insert(aRecord.end(),p,p + aText.Length() * sizeof(uint16_t));
+        }
+
+    /** Reads values from a record, failing if the record is too short. */
+    class RecordReader
+        {
+        public:
+        RecordReader(const std::vector<uint8_t>& aRecord): m_data(aRecord.data()), m_end(aRecord.data() + aRecord.size()) { }
+        template<class T> bool Read(T& aValue)
+            {
+            if (size_t(m_end - m_data) < sizeof(T))
+                return false;
+            memcpy(&aValue,m_data,sizeof(T));
+            m_data += sizeof(T);
+            return true;
+            }
+        bool Read(String& aText)
+            {
+            uint32_t length = 0;
+            if (!Read(length) || size_t(m_end - m_data) / sizeof(uint16_t) < length)
+                return false;
+            std::vector<uint16_t> text(length);
+            if (length)
+                memcpy(text.data(),m_data,length * sizeof(uint16_t));
+            aText = String(text.data(),length);
+            m_data += length * sizeof(uint16_t);
+            return true;
+            }
+
+        private:
+        const uint8_t* m_data;
+        const uint8_t* m_end;
+        };
+
+    Result Write(const std::vector<uint8_t>& aRecord)
+        {
+        if (!m_journal)
+            return KErrorIo;
+        uint32_t header[2] = { uint32_t(aRecord.size()), m_crc_generator.Generate(0,aRecord.data(),aRecord.size()) };
+        if (fwrite(header,sizeof(header),1,m_journal) != 1 ||
+            fwrite(aRecord.data(),aRecord.size(),1,m_journal) != 1 ||
+            fflush(m_journal))
+            return KErrorIo;
+        m_journal_size += sizeof(header) + aRecord.size();
+        // The change has been made and journaled, so a failure to compact is kept for WaitForCompaction instead of being returned.
+        if (m_compaction_threshold && m_journal_size > m_compaction_threshold)
+            {
+            Result error = Compact();
+            if (error)
+                {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_compaction_error = error;
+                }
+            }
+        return KErrorNone;
+        }
+
+    /** Reopens the journal for appending after a compaction has failed, and returns aError. */
+    Result ReopenJournal(Result aError)
+        {
+        m_journal = fopen(m_journal_file_name.c_str(),"ab");
+        std::error_code ec;
+        m_journal_size = m_journal ? uint64_t(std::filesystem::file_size(m_journal_file_name,ec)) : 0;
+        return aError;
+        }
+
+    /** Replays a journal file. If aTruncate is true, a damaged or incomplete tail is removed from the file. */
+    Result Replay(const std::string& aFileName,bool aTruncate)
+        {
+        std::vector<uint8_t> data;
+        std::error_code ec;
+        if (!std::filesystem::exists(aFileName,ec))
+            return KErrorNone;
+        Result error = ReadFile(aFileName,data);
+        if (error)
+            return error;
+
+        size_t pos = 0;
+        size_t end = ValidLength(data);
+        std::vector<uint8_t> record;
+        while (pos < end)
+            {
+            uint32_t size;
+            memcpy(&size,data.data() + pos,sizeof(size));
+            pos += 2 * sizeof(uint32_t);
+            record.assign(data.begin() + pos,data.begin() + pos + size);
+            error = Apply(record);
+            if (error)
+                return error;
+            pos += size;
+            }
+
+        if (aTruncate && pos < data.size())
+            {
+            std::filesystem::resize_file(aFileName,pos,ec);
+            if (ec)
+                return KErrorIo;
+            }
+        return KErrorNone;
+        }
+
+    /** Returns the length of the complete records at the start of a journal, excluding any damaged or incomplete tail. */
+    size_t ValidLength(const std::vector<uint8_t>& aData) const
+        {
+        size_t pos = 0;
+        while (aData.size() - pos >= 2 * sizeof(uint32_t))
+            {
+            uint32_t header[2];
+            memcpy(header,aData.data() + pos,sizeof(header));
+            if (aData.size() - pos - sizeof(header) < header[0] ||
+                m_crc_generator.Generate(0,aData.data() + pos + sizeof(header),header[0]) != header[1])
+                break;
+            pos += sizeof(header) + header[0];
+            }
+        return pos;
+        }
+
+    Result Apply(const std::vector<uint8_t>& aRecord)
+        {
+        RecordReader reader(aRecord);
+        uint8_t type = 0;
+        if (!reader.Read(type))
+            return KErrorCorrupt;
+        if (type == KInsertRecord)
+            {
+            uint64_t id = 0;
+            uint32_t feature_info = 0;
+            uint8_t coord_type = 0, closed = 0;
+            String layer, string_attributes;
+            uint32_t contour_count = 0;
+            if (!reader.Read(id) || !reader.Read(feature_info) || !reader.Read(coord_type) || !reader.Read(closed) ||
+                !reader.Read(layer) || !reader.Read(string_attributes) || !reader.Read(contour_count))
+                return KErrorCorrupt;
+            Geometry geometry(CoordType(coord_type),closed != 0);
+            for (uint32_t i = 0; i < contour_count; i++)
+                {
+                uint32_t point_count = 0;
+                if (!reader.Read(point_count))
+                    return KErrorCorrupt;
+                geometry.BeginContour();
+                for (uint32_t j = 0; j < point_count; j++)
+                    {
+                    double x = 0, y = 0;
+                    uint8_t point_type = 0;
+                    if (!reader.Read(x) || !reader.Read(y) || !reader.Read(point_type))
+                        return KErrorCorrupt;
+                    geometry.AppendPoint(x,y,PointType(point_type));
+                    }
+                }
+            return m_framework.InsertMapObject(m_map_handle,layer,geometry,string_attributes,FeatureInfo::FromRawValue(feature_info),id,true);
+            }
+        if (type == KDeleteRecord)
+            {
+            uint64_t start_id = 0, end_id = 0, deleted_count = 0;
+            String condition;
+            if (!reader.Read(start_id) || !reader.Read(end_id) || !reader.Read(condition))
+                return KErrorCorrupt;
+            return m_framework.DeleteMapObjects(m_map_handle,start_id,end_id,deleted_count,condition);
+            }
+        return KErrorCorrupt;
+        }
+
+    /** Writes a snapshot to a temporary file, syncs it, replaces the base file with it, then deletes the old journal. */
+    Result WriteBaseFile(const std::vector<uint8_t>& aSnapshot)
+        {
+        std::string temp_file_name = m_base_file_name + ".tmp";
+        FILE* file = fopen(temp_file_name.c_str(),"wb");
+        if (!file)
+            return KErrorIo;
+        bool ok = (aSnapshot.empty() || fwrite(aSnapshot.data(),aSnapshot.size(),1,file) == 1) && SyncFile(file);
+        ok = !fclose(file) && ok;
+        std::error_code ec;
+        if (ok)
+            std::filesystem::rename(temp_file_name,m_base_file_name,ec);
+        if (!ok || ec)
+            {
+            std::filesystem::remove(temp_file_name,ec);
+            return KErrorIo;
+            }
+        // The rename must be durable before the old journal, which it replaces, is removed.
+        if (!SyncDirectory(m_base_file_name))
+            return KErrorIo;
+        std::filesystem::remove(m_old_journal_file_name,ec);
+        return KErrorNone;
+        }
+
+    /** Flushes a file and forces its data to be written to permanent storage. */
+    static bool SyncFile(FILE* aFile)
+        {
+        if (fflush(aFile))
+            return false;
+#ifdef _WIN32
+        return !_commit(_fileno(aFile));
+#else
+        return !fsync(fileno(aFile));
+#endif
+        }
+
+    /**
+    Forces the directory containing aFileName to be written to permanent storage, so that renames within it survive a crash.
+    Windows provides no way to sync a directory, so there this does nothing.
+    */
+    static bool SyncDirectory(const std::string& aFileName)
+        {
+#ifdef _WIN32
+        (void)aFileName;
+        return true;
+#else
+        std::string dir = std::filesystem::path(aFileName).parent_path().string();
+        int fd = open(dir.empty() ? "." : dir.c_str(),O_RDONLY);
+        if (fd < 0)
+            return false;
+        bool ok = !fsync(fd);
+        close(fd);
+        return ok;
+#endif
+        }
+
+    static Result ReadFile(const std::string& aFileName,std::vector<uint8_t>& aData)
+        {
+        FILE* file = fopen(aFileName.c_str(),"rb");
+        if (!file)
+            return KErrorIo;
+        aData.clear();
+        uint8_t buffer[65536];
+        size_t n;
+        while ((n = fread(buffer,1,sizeof(buffer),file)) > 0)
+            aData.insert(aData.end(),buffer,buffer + n);
+        bool ok = !ferror(file);
+        fclose(file);
+        return ok ? KErrorNone : KErrorIo;
+        }
+
+    Framework& m_framework;
+    uint32_t m_map_handle;
+    std::string m_base_file_name;
+    std::string m_journal_file_name;
+    std::string m_old_journal_file_name;
+    FILE* m_journal = nullptr;
+    uint64_t m_journal_size = 0;
+    uint64_t m_compaction_threshold = 0;
+    CRCGenerator m_crc_generator;
+    std::thread m_compaction_thread;
+    std::mutex m_mutex;
+    Result m_compaction_error = KErrorNone;
+    };
+
+} // namespace CartoTypeCore
@@ -0,0 +1,280 @@
+/*
+cartotype_map_loader.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <cartotype_framework_observer.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace CartoTypeCore
+{
+
+/**
+Loads maps on a background thread, so that adding a map to a running application or server
+does not stall the threads drawing maps.
+
+Opening a CTM1 file reads and checks its header, index levels and metadata, which can take a noticeable time.
+A MapDataLoader does that work on its own thread, creating a new FrameworkMapDataSet which contains
+the maps of an existing data set plus the new ones, and passes it to a callback when it is ready.
+The existing data set is not changed, so drawing can continue using it; the callback decides when
+to switch to the new one: for example, by creating new Framework objects that share it.
+
+Loads are done one at a time in the order they are requested.
+*/
+class MapDataLoader
+    {
+    public:
+    /**
+    A function called on the loader's thread when a load has finished. If aError is KErrorNone,
+    aMapDataSet is the new data set; otherwise it is null.
+    */
+    using ReadyCallBack = std::function<void(Result aError,std::shared_ptr<FrameworkMapDataSet> aMapDataSet)>;
+
+    /** Creates a map data loader which creates data sets using aEngine. */
+    explicit MapDataLoader(std::shared_ptr<FrameworkEngine> aEngine):
+        m_engine(aEngine),
+        m_thread([this]() { Run(); })
+        {
+        }
+
+    /** Finishes the current load, abandons any others, and stops the loader's thread. */
+    ~MapDataLoader()
+        {
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+            m_job_queue.clear();
+            }
+        m_condition.notify_all();
+        m_thread.join();
+        }
+
+    MapDataLoader(const MapDataLoader&) = delete;
+    MapDataLoader(MapDataLoader&&) = delete;
+    void operator=(const MapDataLoader&) = delete;
+    void operator=(MapDataLoader&&) = delete;
+
+    /**
+    Requests a new data set containing the maps in aBase, if it is not null, followed by the maps in aMapFileNames,
+    and returns immediately. When the data set is ready, or if there is an error, aCallBack is called.
+    aBase may be in use by other threads for drawing, but must not have maps loaded into it or unloaded from it
+    until the callback has been called.
+    */
+    void Load(std::shared_ptr<FrameworkMapDataSet> aBase,std::vector<String> aMapFileNames,ReadyCallBack aCallBack)
+        {
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job_queue.push_back(Job { aBase,std::move(aMapFileNames),std::move(aCallBack) });
+            }
+        m_condition.notify_one();
+        }
+
+    /** Loads a data set immediately, on the calling thread, in the same way as a background load. */
+    std::shared_ptr<FrameworkMapDataSet> LoadNow(Result& aError,std::shared_ptr<FrameworkMapDataSet> aBase,const std::vector<String>& aMapFileNames)
+        {
+        aError = KErrorNone;
+        std::shared_ptr<FrameworkMapDataSet> map_data_set;
+        size_t index = 0;
+        if (aBase)
+            map_data_set = aBase->Copy(aError,m_engine);
+        else if (aMapFileNames.empty())
+            aError = KErrorInvalidArgument;
+        else
+            map_data_set = FrameworkMapDataSet::New(aError,m_engine,aMapFileNames[index++]);
+        while (!aError && index < aMapFileNames.size())
+            aError = map_data_set->LoadMapData(aMapFileNames[index++],nullptr);
+        if (aError)
+            return nullptr;
+
+        // Read the layer names and metadata now so that the first draw using the new data set does not have to.
+        map_data_set->LayerNames();
+        for (size_t i = 0; i < map_data_set->MapCount(); i++)
+            map_data_set->MapMetaData(i);
+        return map_data_set;
+        }
+
+    private:
+    class Job
+        {
+        public:
+        std::shared_ptr<FrameworkMapDataSet> Base;
+        std::vector<String> MapFileNames;
+        ReadyCallBack CallBack;
+        };
+
+    void Run()
+        {
+        for (;;)
+            {
+            Job job;
+                {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock,[this]() { return m_stop || !m_job_queue.empty(); });
+                if (m_stop)
+                    return;
+                job = std::move(m_job_queue.front());
+                m_job_queue.pop_front();
+                }
+            Result error;
+            auto map_data_set = LoadNow(error,job.Base,job.MapFileNames);
+            job.Base = nullptr;
+            if (job.CallBack)
+                job.CallBack(error,map_data_set);
+            }
+        }
+
+    std::shared_ptr<FrameworkEngine> m_engine;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<Job> m_job_queue;
+    bool m_stop = false;
+    std::thread m_thread;
+    };
+
+/** A version of the map data published by MapDataVersions. */
+class MapDataVersion
+    {
+    public:
+    /** The data set. */
+    std::shared_ptr<FrameworkMapDataSet> MapDataSet;
+    /** The version number, which starts at 1 and increases each time a new version is published. */
+    uint64_t Number = 0;
+    };
+
+/**
+Publishes versions of the map data to many threads, allowing map files to be replaced
+without stopping drawing: a read-copy-update scheme.
+
+Readers pin the current version by taking a shared pointer to it, and use it for as long as they like;
+a pinned data set is never modified. Publish makes a new version current atomically.
+Each data set is freed when the last reader using it releases it. A new version is usually
+made by a MapDataLoader: for example, to replace a map, load a new data set from scratch with the
+new file and publish it from the ready callback.
+*/
+class MapDataVersions
+    {
+    public:
+    /** Creates a version history whose first version contains aMapDataSet. */
+    explicit MapDataVersions(std::shared_ptr<FrameworkMapDataSet> aMapDataSet)
+        {
+        Publish(aMapDataSet);
+        }
+
+    /** Returns the current version; holding the returned pointer keeps the version's data set alive. */
+    std::shared_ptr<const MapDataVersion> Current() const
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_current;
+        }
+
+    /** Returns the current version number. */
+    uint64_t CurrentNumber() const
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_current->Number;
+        }
+
+    /**
+    Makes aMapDataSet the current version and calls OnMainDataChange for every observer.
+    Returns the new version number. Observers are called on the calling thread.
+    */
+    uint64_t Publish(std::shared_ptr<FrameworkMapDataSet> aMapDataSet)
+        {
+        auto v = std::make_shared<MapDataVersion>();
+        v->MapDataSet = aMapDataSet;
+        std::vector<std::shared_ptr<MFrameworkObserver>> observer_array;
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            v->Number = m_current ? m_current->Number + 1 : 1;
+            m_current = v;
+            for (auto p = m_observer_array.begin(); p != m_observer_array.end(); )
+                {
+                auto o = p->lock();
+                if (o)
+                    {
+                    observer_array.push_back(o);
+                    ++p;
+                    }
+                else
+                    p = m_observer_array.erase(p);
+                }
+            }
+        for (auto& o : observer_array)
+            o->OnMainDataChange();
+        return v->Number;
+        }
+
+    /** Adds an observer to be notified when a new version is published. */
+    void AddObserver(std::weak_ptr<MFrameworkObserver> aObserver)
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_observer_array.push_back(aObserver);
+        }
+
+    private:
+    mutable std::mutex m_mutex;
+    std::shared_ptr<const MapDataVersion> m_current;
+    std::vector<std::weak_ptr<MFrameworkObserver>> m_observer_array;
+    };
+
+/**
+A framework which uses the current version of the map data published by a MapDataVersions object.
+Each drawing thread owns one. Get returns the thread's framework, first replacing it by a new one
+if a new version has been published since the last call, so that a thread changes versions only
+between frames, and the old version is released as soon as no thread uses it.
+*/
+class VersionedFramework
+    {
+    public:
+    /**
+    A function to create a framework using a given data set. aOldFramework is the framework being replaced,
+    or null, and can be used to copy the view, style sheet and other state.
+    */
+    using FrameworkFactory = std::function<std::unique_ptr<Framework>(Result& aError,std::shared_ptr<FrameworkMapDataSet> aMapDataSet,const Framework* aOldFramework)>;
+
+    /** Creates a versioned framework using the versions in aVersions, creating frameworks using aFactory. */
+    VersionedFramework(const MapDataVersions& aVersions,FrameworkFactory aFactory):
+        m_versions(aVersions),
+        m_factory(std::move(aFactory))
+        {
+        }
+
+    /**
+    Returns a framework using the current version of the map data, or null if a framework could not be created.
+    If creating a framework for a new version fails, the error is returned and the framework for the previous version
+    continues to be used.
+    */
+    Framework* Get(Result& aError)
+        {
+        aError = KErrorNone;
+        if (m_framework && m_version->Number == m_versions.CurrentNumber())
+            return m_framework.get();
+        auto version = m_versions.Current();
+        auto framework = m_factory(aError,version->MapDataSet,m_framework.get());
+        if (!aError && !framework)
+            aError = KErrorGeneral;
+        if (aError)
+            return m_framework.get();
+        m_framework = std::move(framework);
+        m_version = version;
+        return m_framework.get();
+        }
+
+    /** Returns the version number used by the current framework, or zero if there is none. */
+    uint64_t VersionNumber() const { return m_version ? m_version->Number : 0; }
+
+    private:
+    const MapDataVersions& m_versions;
+    FrameworkFactory m_factory;
+    std::shared_ptr<const MapDataVersion> m_version;
+    std::unique_ptr<Framework> m_framework;
+    };
+
+} // namespace CartoTypeCore
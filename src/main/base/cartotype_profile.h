@@ -0,0 +1,255 @@
+/*
+cartotype_profile.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_stream.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace CartoTypeCore
+{
+
+/**
+Stages of work for which time and call counts can be recorded by a Profiler, using ScopedTimer.
+Only application code is timed: the drawing code inside the library does not use ScopedTimer,
+so the time spent in functions like Framework::MapBitmap appears only in the frame totals.
+*/
+enum class ProfileStage
+    {
+    /** Encoding bitmaps as PNG. */
+    PngEncode,
+    /** Any other work. */
+    Other
+    };
+
+/** The number of values in ProfileStage. */
+constexpr size_t KProfileStageCount = size_t(ProfileStage::Other) + 1;
+
+/** Returns a short name for a profile stage, used when exporting traces. */
+inline const char* ProfileStageName(ProfileStage aStage)
+    {
+    static const char* const name[KProfileStageCount] = { "png_encode", "other" };
+    return name[size_t(aStage)];
+    }
+
+/** The number of calls and total time recorded for a single profile stage. */
+class ProfileCounter
+    {
+    public:
+    /** The number of times the stage was entered. */
+    uint64_t Count = 0;
+    /** The total time spent in the stage in seconds. */
+    double Seconds = 0;
+    };
+
+/** Counters for all the stages of a single frame: for example, a call to MapBitmap or TileBitmap. */
+class FrameProfile
+    {
+    public:
+    /** Returns the counter for a given stage. */
+    const ProfileCounter& operator[](ProfileStage aStage) const { return Counter[size_t(aStage)]; }
+    /** Returns a writable reference to the counter for a given stage. */
+    ProfileCounter& operator[](ProfileStage aStage) { return Counter[size_t(aStage)]; }
+
+    /** The name of the frame, such as the name of the function being profiled. */
+    std::string Name;
+    /** The total duration of the frame in seconds. */
+    double Seconds = 0;
+    /** The counters, indexed by ProfileStage. */
+    std::array<ProfileCounter,KProfileStageCount> Counter;
+    };
+
+/**
+A profiler records the duration of frames, such as calls to draw a map or a tile, and the time spent in the stages timed within them.
+Profiling is switched on and off at run time using Enable; when it is off, ScopedTimer objects
+cost a single test of a flag. A profiler is not thread-safe; use one per thread and make it
+current for that thread using SetCurrent.
+*/
+class Profiler
+    {
+    public:
+    /** A type for time points used by the profiler. */
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    Profiler(): m_origin(std::chrono::steady_clock::now()) { }
+
+    /** Enables or disables profiling and returns the previous state. */
+    bool Enable(bool aEnable) { bool p = m_enabled; m_enabled = aEnable; return p; }
+    /** Returns true if profiling is enabled. */
+    bool Enabled() const { return m_enabled; }
+    /** Enables or disables recording of individual events for trace export; returns the previous state. */
+    bool EnableTrace(bool aEnable) { bool p = m_trace; m_trace = aEnable; return p; }
+
+    /** Starts a new frame, discarding the counters of the current frame if it was not ended. */
+    void BeginFrame(const char* aName)
+        {
+        if (!m_enabled)
+            return;
+        m_frame = FrameProfile();
+        m_frame.Name = aName;
+        m_frame_start = std::chrono::steady_clock::now();
+        m_in_frame = true;
+        }
+    /** Ends the current frame and adds it to the completed frames. */
+    void EndFrame()
+        {
+        if (!m_enabled || !m_in_frame)
+            return;
+        TimePoint end = std::chrono::steady_clock::now();
+        m_frame.Seconds = std::chrono::duration<double>(end - m_frame_start).count();
+        AddEvent(m_frame.Name.c_str(),m_frame_start,end);
+        m_frame_array.push_back(std::move(m_frame));
+        m_in_frame = false;
+        }
+
+    /** Records a period of time spent in a stage. Does nothing if there is no current frame. */
+    void Record(ProfileStage aStage,TimePoint aStart,TimePoint aEnd)
+        {
+        if (!m_in_frame)
+            return;
+        ProfileCounter& c = m_frame[aStage];
+        c.Count++;
+        c.Seconds += std::chrono::duration<double>(aEnd - aStart).count();
+        AddEvent(ProfileStageName(aStage),aStart,aEnd);
+        }
+
+    /** Returns the completed frames. */
+    const std::vector<FrameProfile>& Frames() const { return m_frame_array; }
+    /** Returns the most recently completed frame, or an empty frame if there is none. */
+    FrameProfile LastFrame() const { return m_frame_array.empty() ? FrameProfile() : m_frame_array.back(); }
+    /** Discards all completed frames and trace events. */
+    void Clear() { m_frame_array.clear(); m_event_array.clear(); }
+
+    /** Writes the recorded events in the Chrome trace-event JSON format, which can be loaded by chrome://tracing or Perfetto. */
+    void WriteChromeTrace(OutputStream& aOutput) const
+        {
+        aOutput.WriteString("{\"traceEvents\":[\n");
+        for (size_t i = 0; i < m_event_array.size(); i++)
+            {
+            const TraceEvent& e = m_event_array[i];
+            std::string s = "{\"name\":" + JsonString(e.Name) + ",\"cat\":\"cartotype\",\"ph\":\"X\",\"pid\":1,\"tid\":" +
+                            std::to_string(e.ThreadId) + ",\"ts\":" + std::to_string(e.Start) + ",\"dur\":" + std::to_string(e.Duration) + "}";
+            if (i + 1 < m_event_array.size())
+                s += ",";
+            s += "\n";
+            aOutput.WriteString(s);
+            }
+        aOutput.WriteString("]}\n");
+        }
+
+    /** Returns the profiler used by ScopedTimer objects on the current thread, or null if there is none. */
+    static Profiler* Current() { return CurrentRef(); }
+    /** Sets the profiler used by ScopedTimer objects on the current thread; aProfiler may be null. */
+    static void SetCurrent(Profiler* aProfiler) { CurrentRef() = aProfiler; }
+
+    private:
+    class TraceEvent
+        {
+        public:
+        std::string Name;
+        int64_t Start = 0;      // microseconds since the profiler was created
+        int64_t Duration = 0;   // microseconds
+        uint32_t ThreadId = 0;  // a small number identifying the recording thread
+        };
+
+    static uint32_t ThreadId()
+        {
+        static std::atomic<uint32_t> next_id { 1 };
+        static thread_local uint32_t id = next_id++;
+        return id;
+        }
+
+    static std::string JsonString(const std::string& aText)
+        {
+        std::string s = "\"";
+        for (char c : aText)
+            {
+            if (c == '"' || c == '\\')
+                {
+                s += '\\';
+                s += c;
+                }
+            else if (uint8_t(c) < 0x20)
+                {
+                const char* hex = "0123456789abcdef";
+                s += "\\u00";
+                s += hex[c >> 4];
+                s += hex[c & 15];
+                }
+            else
+                s += c;
+            }
+        s += '"';
+        return s;
+        }
+
+    static Profiler*& CurrentRef()
+        {
+        static thread_local Profiler* current = nullptr;
+        return current;
+        }
+
+    void AddEvent(const char* aName,TimePoint aStart,TimePoint aEnd)
+        {
+        if (!m_trace)
+            return;
+        TraceEvent e;
+        e.Name = aName;
+        e.Start = std::chrono::duration_cast<std::chrono::microseconds>(aStart - m_origin).count();
+        e.Duration = std::chrono::duration_cast<std::chrono::microseconds>(aEnd - aStart).count();
+        e.ThreadId = ThreadId();
+        m_event_array.push_back(std::move(e));
+        }
+
+    bool m_enabled = false;
+    bool m_trace = false;
+    bool m_in_frame = false;
+    TimePoint m_origin;
+    TimePoint m_frame_start;
+    FrameProfile m_frame;
+    std::vector<FrameProfile> m_frame_array;
+    std::vector<TraceEvent> m_event_array;
+    };
+
+/**
+Records the time from its construction to its destruction against a profile stage,
+using the current thread's profiler. Does nothing if there is no current profiler or it is disabled.
+*/
+class ScopedTimer
+    {
+    public:
+    /** Starts timing a stage using the current thread's profiler. */
+    explicit ScopedTimer(ProfileStage aStage): ScopedTimer(Profiler::Current(),aStage) { }
+    /** Starts timing a stage using a specified profiler, which may be null. */
+    ScopedTimer(Profiler* aProfiler,ProfileStage aStage):
+        m_profiler(aProfiler && aProfiler->Enabled() ? aProfiler : nullptr),
+        m_stage(aStage)
+        {
+        if (m_profiler)
+            m_start = std::chrono::steady_clock::now();
+        }
+    ~ScopedTimer()
+        {
+        if (m_profiler)
+            m_profiler->Record(m_stage,m_start,std::chrono::steady_clock::now());
+        }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer(ScopedTimer&&) = delete;
+    void operator=(const ScopedTimer&) = delete;
+    void operator=(ScopedTimer&&) = delete;
+
+    private:
+    Profiler* m_profiler;
+    ProfileStage m_stage;
+    Profiler::TimePoint m_start;
+    };
+
+} // namespace CartoTypeCore
@@ -0,0 +1,189 @@
+/*
+cartotype_route_corridor.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <cartotype_hash.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+
+namespace CartoTypeCore
+{
+
+/** An object found near a route by RouteCorridorIndex. */
+class RouteCorridorItem
+    {
+    public:
+    /** The distance along the route, in meters, of the point on the route nearest to the object. */
+    double DistanceAlongRoute = 0;
+    /** The distance of the object from the route in meters. */
+    double DistanceFromRoute = 0;
+    /** The object. */
+    std::shared_ptr<MapObject> Object;
+    };
+
+/**
+An index of the objects near a route, sorted by distance along the route, for warnings about
+speed cameras, hazards and other objects ahead.
+
+Nearby object warnings set by Framework::SetNearbyObjectWarning search the map around the vehicle
+on every navigation fix. A RouteCorridorIndex searches a corridor along the whole route once, when the
+route is created, after which the objects ahead of any position are found by a binary search, so that
+fixes can be processed many times a second at negligible cost. The index must be rebuilt when the
+route changes.
+*/
+class RouteCorridorIndex
+    {
+    public:
+    /**
+    Finds the objects in aLayers, satisfying aCondition if it is not empty, within aCorridorWidthInMeters of aRoute.
+    The route is searched in pieces no longer than about aPieceLengthInMeters, each clipped by its own envelope,
+    so that long routes do not need enormous clip polygons. Objects found in more than one piece are included once:
+    objects with IDs are identified by ID, and others by their layer, attributes and geometry.
+    */
+    Result Build(const Framework& aFramework,const Route& aRoute,const String& aLayers,const String& aCondition,
+                 double aCorridorWidthInMeters,double aPieceLengthInMeters = 5000)
+        {
+        m_item_array.clear();
+        const OnCurveContour& path = aRoute.Path;
+        if (path.Points() < 2 || aRoute.Distance <= 0)
+            return KErrorNone;
+
+        // The route's own ratio of map units to meters is accurate enough for the envelopes, which are only a coarse filter.
+        double path_length = 0;
+        for (size_t i = 1; i < path.Points(); i++)
+            path_length += Length(path.Point(i - 1),path.Point(i));
+        double map_units_per_meter = path_length / aRoute.Distance;
+        double offset = aCorridorWidthInMeters * map_units_per_meter * 1.25;
+        double piece_length = std::max(aPieceLengthInMeters,aCorridorWidthInMeters) * map_units_per_meter;
+
+        FindParam param;
+        param.Layers = aLayers;
+        param.Condition = aCondition;
+        param.TimeOut = 0;
+        std::unordered_set<uint64_t> id_set;
+        std::unordered_set<uint64_t> geometry_set;
+        size_t start = 0;
+        double start_distance = 0;
+        while (start + 1 < path.Points())
+            {
+            // Objects near the start of the piece may be nearest to the route a little before it.
+            double previous_distance = std::max(0.0,start_distance / map_units_per_meter - aCorridorWidthInMeters);
+            OnCurveContour piece;
+            piece.AppendPointEvenIfSame(Point(path.Point(start).X,path.Point(start).Y));
+            double length = 0;
+            size_t end = start + 1;
+            for (; end < path.Points(); end++)
+                {
+                piece.AppendPointEvenIfSame(Point(path.Point(end).X,path.Point(end).Y));
+                length += Length(path.Point(end - 1),path.Point(end));
+                if (length >= piece_length)
+                    break;
+                }
+            start = std::min(end,path.Points() - 1);
+            start_distance += length;
+
+            param.Clip = Geometry(piece.Envelope(offset),CoordType::Map,true);
+            MapObjectArray found;
+            Result error = aFramework.Find(found,param);
+            if (error)
+                return error;
+            for (auto& object : found)
+                {
+                uint64_t key = object->Id() ? object->Id() : GeometryKey(*object);
+                auto& key_set = object->Id() ? id_set : geometry_set;
+                if (key_set.count(key))
+                    continue;
+                PointFP center = object->Center();
+                NearestSegmentInfo info = aRoute.NearestSegment(Point(int32_t(std::lround(center.X)),int32_t(std::lround(center.Y))),-1,previous_distance);
+                if (info.SegmentIndex < 0 || info.DistanceToRoute > aCorridorWidthInMeters)
+                    continue;
+                key_set.insert(key);
+                RouteCorridorItem item;
+                item.DistanceAlongRoute = info.DistanceAlongRoute;
+                item.DistanceFromRoute = info.DistanceToRoute;
+                item.Object = std::move(object);
+                m_item_array.push_back(std::move(item));
+                }
+            }
+
+        std::sort(m_item_array.begin(),m_item_array.end(),[](const RouteCorridorItem& aA,const RouteCorridorItem& aB)
+            {
+            return aA.DistanceAlongRoute < aB.DistanceAlongRoute;
+            });
+        return KErrorNone;
+        }
+
+    /**
+    Returns up to aMaxObjectCount objects at or after aDistanceAlongRoute and no more than aMaxDistanceAhead meters beyond it,
+    in order of distance along the route.
+    */
+    std::vector<const RouteCorridorItem*> Ahead(double aDistanceAlongRoute,double aMaxDistanceAhead,size_t aMaxObjectCount) const
+        {
+        std::vector<const RouteCorridorItem*> result;
+        auto p = std::lower_bound(m_item_array.begin(),m_item_array.end(),aDistanceAlongRoute,[](const RouteCorridorItem& aItem,double aDistance)
+            {
+            return aItem.DistanceAlongRoute < aDistance;
+            });
+        double limit = aDistanceAlongRoute + aMaxDistanceAhead;
+        for (; p != m_item_array.end() && p->DistanceAlongRoute <= limit && result.size() < aMaxObjectCount; ++p)
+            result.push_back(&*p);
+        return result;
+        }
+
+    /**
+    Returns the objects ahead of the current navigation position of aFramework, which must be navigating
+    along the route used to build the index.
+    */
+    std::vector<const RouteCorridorItem*> Ahead(Framework& aFramework,double aMaxDistanceAhead,size_t aMaxObjectCount) const
+        {
+        const Route* route = aFramework.Route();
+        if (!route)
+            return { };
+        return Ahead(route->Distance - aFramework.DistanceToDestination(),aMaxDistanceAhead,aMaxObjectCount);
+        }
+
+    /** Returns the number of objects in the index. */
+    size_t Size() const { return m_item_array.size(); }
+    /** Returns an object selected by its index, in order of distance along the route. */
+    const RouteCorridorItem& operator[](size_t aIndex) const { return m_item_array[aIndex]; }
+
+    private:
+    /** Returns a hash identifying an object without an ID, made from its layer, type, attributes and points. */
+    static uint64_t GeometryKey(const MapObject& aObject)
+        {
+        Hasher64 hasher;
+        auto add_string = [&hasher](const MString& aText)
+            {
+            hasher.AddValue(uint64_t(aText.Length())).Add(aText.Data(),aText.Length() * sizeof(uint16_t));
+            };
+        add_string(aObject.LayerName());
+        add_string(aObject.StringAttributes());
+        hasher.AddValue(aObject.Type()).AddValue(uint64_t(aObject.Contours()));
+        for (size_t i = 0; i < aObject.Contours(); i++)
+            {
+            ContourView contour = aObject.ContourByIndex(i);
+            hasher.AddValue(uint64_t(contour.Points()));
+            for (size_t j = 0; j < contour.Points(); j++)
+                {
+                OutlinePoint point = contour.Point(j);
+                hasher.AddValue(point.X).AddValue(point.Y);
+                }
+            }
+        return hasher.Value();
+        }
+
+    static double Length(const OutlinePoint& aA,const OutlinePoint& aB)
+        {
+        return std::hypot(double(aB.X) - aA.X,double(aB.Y) - aA.Y);
+        }
+
+    std::vector<RouteCorridorItem> m_item_array;
+    };
+
+} // namespace CartoTypeCore
@@ -0,0 +1,266 @@
+/*
+cartotype_single_flight.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_buffer_pool.h>
+#include <cartotype_framework.h>
+#include <cartotype_hash.h>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+namespace CartoTypeCore
+{
+
+/**
+Coalesces identical concurrent calls. When several threads ask for the value for the same key at the same time,
+the first does the work and the others wait for it and share its result. Nothing is cached: once the work
+is finished the next call for the key does it again.
+*/
+template<class TKey,class TValue,class THash = std::hash<TKey>> class SingleFlight
+    {
+    public:
+    /**
+    Returns the result of calling aFunction, which takes no arguments and returns a TValue. If a call for an equal key
+    is already in progress on another thread, waits for it and returns its result instead of calling aFunction.
+    If aShared is non-null, *aShared is set to true if the result came from another call. If aFunction throws an exception
+    it is thrown to every caller waiting for it.
+    */
+    template<class TFunction> std::shared_ptr<const TValue> Do(const TKey& aKey,TFunction&& aFunction,bool* aShared = nullptr)
+        {
+        std::promise<std::shared_ptr<const TValue>> promise;
+        std::shared_future<std::shared_ptr<const TValue>> own_future = promise.get_future().share();
+        std::shared_future<std::shared_ptr<const TValue>> future;
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto p = m_call_map.find(aKey);
+            if (p != m_call_map.end())
+                future = p->second;
+            else
+                m_call_map.emplace(aKey,own_future);
+            }
+        if (aShared)
+            *aShared = future.valid();
+        if (future.valid())
+            {
+            m_shared_calls++;
+            return future.get();
+            }
+
+        m_calls++;
+        try
+            {
+            promise.set_value(std::make_shared<const TValue>(aFunction()));
+            }
+        catch (...)
+            {
+            promise.set_exception(std::current_exception());
+            }
+            {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_call_map.erase(aKey);
+            }
+        return own_future.get();
+        }
+
+    /** Returns the number of calls which did the work. */
+    uint64_t Calls() const { return m_calls; }
+    /** Returns the number of calls which shared the result of another call. */
+    uint64_t SharedCalls() const { return m_shared_calls; }
+
+    private:
+    std::mutex m_mutex;
+    std::unordered_map<TKey,std::shared_future<std::shared_ptr<const TValue>>,THash> m_call_map;
+    std::atomic<uint64_t> m_calls { 0 };
+    std::atomic<uint64_t> m_shared_calls { 0 };
+    };
+
+/**
+Returns a 64-bit hash of everything in a framework's style which affects the appearance of tiles,
+for use in TileKey: the style sheets, the style sheet variables, the blend styles, the night mode setting and color,
+the resolution, the locale, and the 3D building and perspective settings.
+Changes to the map data, such as inserted map objects, are not included.
+*/
+inline uint64_t StyleSheetHash(const Framework& aFramework)
+    {
+    Hasher64 hasher;
+    // Each string is preceded by its length, so that different divisions of the same bytes give different hashes.
+    auto add_text = [&hasher](const void* aData,size_t aLength)
+        {
+        hasher.AddValue(uint64_t(aLength)).Add(aData,aLength);
+        };
+    auto add_string = [&add_text](const MString& aText)
+        {
+        add_text(aText.Data(),aText.Length() * sizeof(uint16_t));
+        };
+
+    for (const auto& s : aFramework.StyleSheetDataArray())
+        {
+        add_text(s.FileName().data(),s.FileName().size());
+        add_text(s.Text().data(),s.Text().size());
+        }
+
+    // VariableDictionary::Apply is not const but does not change the dictionary, whose entries are in sorted order.
+    auto add_variable = [&add_string](const String& aName,const String& aValue)
+        {
+        add_string(aName);
+        add_string(aValue);
+        };
+    const_cast<VariableDictionary&>(aFramework.StyleSheetVariables()).Apply(add_variable);
+
+    auto blend_style_set = aFramework.BlendStyleSet();
+    hasher.AddValue(uint64_t(blend_style_set.size()));
+    for (const auto& b : blend_style_set)
+        {
+        add_string(b.Styles);
+        for (const Color& c : { b.MainColor, b.BorderColor, b.TextColor, b.TextGlowColor, b.IconColor })
+            hasher.AddValue(c.Value);
+        }
+
+    hasher.AddValue(aFramework.NightMode());
+    if (aFramework.NightMode())
+        hasher.AddValue(aFramework.NightModeColor().Value);
+    hasher.AddValue(aFramework.ResolutionDpi());
+    std::string locale = aFramework.Locale();
+    add_text(locale.data(),locale.size());
+    hasher.AddValue(aFramework.Draw3DBuildings()).AddValue(aFramework.Perspective());
+    return hasher.Value();
+    }
+
+/** A key identifying a tile drawn by Framework::TileBitmap, for use with SingleFlight. */
+class TileKey
+    {
+    public:
+    TileKey() = default;
+    /** Creates a key for a tile. aParam may be null, meaning the default parameters. */
+    TileKey(uint64_t aStyleHash,int32_t aTileSizeInPixels,int32_t aZoom,int32_t aX,int32_t aY,const TileBitmapParam* aParam):
+        StyleHash(aStyleHash),
+        TileSize(aTileSizeInPixels),
+        Zoom(aZoom),
+        X(aX),
+        Y(aY)
+        {
+        if (aParam)
+            {
+            DrawMapObjects = aParam->DrawMapObjects;
+            DrawLabels = aParam->DrawLabels;
+            DrawBackground = aParam->DrawBackground;
+            }
+        }
+
+    /** The equality operator. */
+    bool operator==(const TileKey& aOther) const
+        {
+        return StyleHash == aOther.StyleHash && TileSize == aOther.TileSize && Zoom == aOther.Zoom && X == aOther.X && Y == aOther.Y &&
+               DrawMapObjects == aOther.DrawMapObjects && DrawLabels == aOther.DrawLabels && DrawBackground == aOther.DrawBackground;
+        }
+
+    /** A hash of the style sheet and anything else affecting the appearance of the tile. */
+    uint64_t StyleHash = 0;
+    /** The tile size in pixels. */
+    int32_t TileSize = 0;
+    /** The zoom level. */
+    int32_t Zoom = 0;
+    /** The tile's column. */
+    int32_t X = 0;
+    /** The tile's row. */
+    int32_t Y = 0;
+    /** The value of TileBitmapParam::DrawMapObjects. */
+    bool DrawMapObjects = true;
+    /** The value of TileBitmapParam::DrawLabels. */
+    bool DrawLabels = true;
+    /** The value of TileBitmapParam::DrawBackground. */
+    bool DrawBackground = true;
+    };
+
+/** A hash function for TileKey. */
+class TileKeyHash
+    {
+    public:
+    size_t operator()(const TileKey& aKey) const
+        {
+        int32_t value[5] = { aKey.TileSize, aKey.Zoom, aKey.X, aKey.Y, aKey.DrawMapObjects | aKey.DrawLabels << 1 | aKey.DrawBackground << 2 };
+        return size_t(Hash64(value,sizeof(value),aKey.StyleHash));
+        }
+    };
+
+/** A tile encoded as a PNG file by TileRenderCoalescer. */
+class EncodedTile
+    {
+    public:
+    /** The error code returned when drawing or encoding the tile. */
+    Result Error;
+    /** The PNG data, which is empty if there was an error. It is returned to the coalescer's buffer pool when the tile is destroyed. */
+    PooledBuffer Data;
+    };
+
+/**
+Draws PNG tiles for many threads, each using its own framework, drawing each tile only once
+when several threads ask for it at the same time. During bursts of requests for a freshly
+invalidated area most concurrent requests are for the same few tiles, and all but one
+of each set of identical requests can wait for the render instead of repeating it.
+
+The frameworks must all draw identical tiles for identical keys: that is, they must use the
+same map data and the same style sheets, or differences must be reflected in the style hash.
+*/
+class TileRenderCoalescer
+    {
+    public:
+    /**
+    Returns a tile drawn by aFramework and encoded as PNG, or the result of an identical render in progress on another thread.
+    A tile using a label handler has side effects, so it is never shared.
+    */
+    std::shared_ptr<const EncodedTile> PngTile(Framework& aFramework,uint64_t aStyleHash,int32_t aTileSizeInPixels,int32_t aZoom,int32_t aX,int32_t aY,
+                                               const TileBitmapParam* aParam = nullptr,bool* aShared = nullptr)
+        {
+        auto draw = [&]()
+            {
+            EncodedTile tile;
+            Bitmap bitmap = aFramework.TileBitmap(tile.Error,aTileSizeInPixels,aZoom,aX,aY,aParam);
+            if (!tile.Error)
+                {
+                // Start with a buffer big enough for the last tile, so that the encoder rarely has to grow it.
+                PooledOutputStream output(m_buffer_pool,m_png_size_hint);
+                tile.Error = bitmap.WritePng(output,false);
+                if (!tile.Error)
+                    {
+                    m_png_size_hint = output.Length();
+                    tile.Data = output.TakeData();
+                    }
+                }
+            return tile;
+            };
+        if (aParam && aParam->LabelHandler)
+            {
+            if (aShared)
+                *aShared = false;
+            return std::make_shared<const EncodedTile>(draw());
+            }
+        return m_flight.Do(TileKey(aStyleHash,aTileSizeInPixels,aZoom,aX,aY,aParam),draw,aShared);
+        }
+
+    /**
+    Sets the pool supplying the buffers for encoded tiles, which may be shared with other users;
+    by default each coalescer has its own pool.
+    */
+    void SetBufferPool(std::shared_ptr<BufferPool> aPool) { m_buffer_pool = aPool; }
+    /** Returns the pool supplying the buffers for encoded tiles. */
+    const BufferPool& Pool() const { return *m_buffer_pool; }
+
+    /** Returns the number of tiles drawn. */
+    uint64_t Renders() const { return m_flight.Calls(); }
+    /** Returns the number of requests which shared another request's render. */
+    uint64_t SharedRenders() const { return m_flight.SharedCalls(); }
+
+    private:
+    SingleFlight<TileKey,EncodedTile,TileKeyHash> m_flight;
+    std::shared_ptr<BufferPool> m_buffer_pool = BufferPool::New();
+    std::atomic<size_t> m_png_size_hint { 64 * 1024 };
+    };
+
+} // namespace CartoTypeCore
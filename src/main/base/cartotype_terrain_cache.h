@@ -0,0 +1,419 @@
+/*
+cartotype_terrain_cache.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_elevation.h>
+#include <cartotype_single_flight.h>
+#include <cassert>
+#include <cmath>
+#include <list>
+
+// The hillshading kernel uses SSE2 or NEON, which every x86-64 and AArch64 processor has, four pixels at a time.
+#if !defined(CARTOTYPE_NO_SIMD)
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #include <emmintrin.h>
+        #define CARTOTYPE_HILLSHADE_SSE2
+    #elif defined(__aarch64__) && defined(__ARM_NEON)
+        #include <arm_neon.h>
+        #define CARTOTYPE_HILLSHADE_NEON
+    #endif
+#endif
+
+namespace CartoTypeCore
+{
+
+/** Parameters controlling the terrain rasters made by TerrainRasterCache. */
+class TerrainRasterParam
+    {
+    public:
+    /** The size of the square tiles in pixels. */
+    int32_t TileSize = 256;
+    /** The direction the light comes from, in degrees clockwise from north. */
+    double LightAzimuth = 315;
+    /** The height of the light above the horizon in degrees. */
+    double LightAltitude = 45;
+    /** The factor by which heights are multiplied to exaggerate the relief. */
+    double Exaggeration = 1;
+    /**
+    The number of threads used to get the heights of a tile, passed to BatchHeights; zero means the number of hardware threads.
+    The default of one suits applications which make several tiles at once on their own threads.
+    */
+    size_t ThreadCount = 1;
+    };
+
+/** A color ramp mapping heights to colors, used by TerrainRasterCache. */
+class TerrainColorRamp
+    {
+    public:
+    /** Adds a stop: heights between stops have interpolated colors. Stops must be added in increasing order of height. */
+    void AddStop(double aHeight,Color aColor) { m_stop_array.emplace_back(aHeight,aColor); }
+
+    /** Returns the color for a height. */
+    Color ColorAt(double aHeight) const
+        {
+        if (m_stop_array.empty())
+            return Color(0);
+        if (aHeight <= m_stop_array.front().first)
+            return m_stop_array.front().second;
+        for (size_t i = 1; i < m_stop_array.size(); i++)
+            if (aHeight < m_stop_array[i].first)
+                {
+                const auto& a = m_stop_array[i - 1];
+                const auto& b = m_stop_array[i];
+                double f = (aHeight - a.first) / (b.first - a.first);
+                auto mix = [f](int32_t aA,int32_t aB) { return int32_t(std::lround(aA + (aB - aA) * f)); };
+                return Color(mix(a.second.Red(),b.second.Red()),mix(a.second.Green(),b.second.Green()),
+                             mix(a.second.Blue(),b.second.Blue()),mix(a.second.Alpha(),b.second.Alpha()));
+                }
+        return m_stop_array.back().second;
+        }
+
+    /** Returns a hash of the stops, used in cache keys. */
+    uint64_t Hash() const
+        {
+        Hasher64 hasher;
+        for (const auto& s : m_stop_array)
+            hasher.AddValue(s.first).AddValue(s.second.Value);
+        return hasher.Value();
+        }
+
+    private:
+    std::vector<std::pair<double,Color>> m_stop_array;
+    };
+
+/**
+A cache of terrain rasters derived from height data: hillshading as A8 bitmaps and height-colored
+RGBA32 bitmaps, for tiles in the usual web Mercator tiling scheme.
+
+Shading terrain from height data on every redraw is expensive. This cache keeps the height grid of each
+tile and the rasters made from it, keyed by the tile, the light direction, the exaggeration and the color ramp,
+so that redraws, and rasters for a different light direction or ramp, do not fetch the heights again.
+The least recently used entries are discarded when the cache grows beyond its size limit.
+
+The shading uses Horn's slope kernel, computed a row at a time, four pixels at a time using SSE2 or NEON where available;
+define CARTOTYPE_NO_SIMD to use scalar code only. A cache may be used by several threads at once;
+concurrent requests for the same raster make it once.
+*/
+class TerrainRasterCache
+    {
+    public:
+    /** Creates a cache holding up to about aMaxBytes of rasters and height grids. */
+    explicit TerrainRasterCache(size_t aMaxBytes = 64 * 1024 * 1024): m_max_bytes(aMaxBytes) { }
+
+    /**
+    Returns a hillshading bitmap for a tile: an A8 bitmap in which 255 is fully lit and 0 is in full shadow.
+    The heights are obtained from aFramework.
+    */
+    std::shared_ptr<const Bitmap> Hillshade(Result& aError,const Framework& aFramework,int32_t aZoom,int32_t aX,int32_t aY,const TerrainRasterParam& aParam)
+        {
+        Key key { RasterType::Hillshade, aZoom, aX, aY, aParam.TileSize, aParam.LightAzimuth, aParam.LightAltitude, aParam.Exaggeration, 0 };
+        return Raster(aError,aFramework,key,aParam.ThreadCount,[&](const HeightGrid& aGrid) { return MakeHillshade(aGrid,aParam); });
+        }
+
+    /** Returns a bitmap coloring a tile by height using aRamp, as an RGBA32 bitmap. The heights are obtained from aFramework. */
+    std::shared_ptr<const Bitmap> HeightColors(Result& aError,const Framework& aFramework,int32_t aZoom,int32_t aX,int32_t aY,
+                                               const TerrainRasterParam& aParam,const TerrainColorRamp& aRamp)
+        {
+        Key key { RasterType::HeightColors, aZoom, aX, aY, aParam.TileSize, 0, 0, 0, aRamp.Hash() };
+        return Raster(aError,aFramework,key,aParam.ThreadCount,[&](const HeightGrid& aGrid) { return MakeHeightColors(aGrid,aRamp); });
+        }
+
+    /** Discards everything in the cache: for example, when the terrain data changes. */
+    void Clear()
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lru.clear();
+        m_map.clear();
+        m_bytes = 0;
+        }
+
+    /** Returns the approximate number of bytes used by the cache. */
+    size_t Bytes() const
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_bytes;
+        }
+
+    private:
+    enum class RasterType
+        {
+        HeightGrid,
+        Hillshade,
+        HeightColors
+        };
+
+    class Key
+        {
+        public:
+        bool operator==(const Key& aOther) const
+            {
+            return Type == aOther.Type && Zoom == aOther.Zoom && X == aOther.X && Y == aOther.Y && TileSize == aOther.TileSize &&
+                   LightAzimuth == aOther.LightAzimuth && LightAltitude == aOther.LightAltitude && Exaggeration == aOther.Exaggeration &&
+                   RampHash == aOther.RampHash;
+            }
+
+        RasterType Type;
+        int32_t Zoom;
+        int32_t X;
+        int32_t Y;
+        int32_t TileSize;
+        double LightAzimuth;
+        double LightAltitude;
+        double Exaggeration;
+        uint64_t RampHash;
+        };
+
+    class KeyHash
+        {
+        public:
+        size_t operator()(const Key& aKey) const
+            {
+            uint64_t h = aKey.RampHash;
+            auto add = [&h](uint64_t aValue) { h ^= aValue + 0x9E3779B97F4A7C15 + (h << 6) + (h >> 2); };
+            add(uint64_t(aKey.Type));
+            add(uint32_t(aKey.Zoom));
+            add(uint32_t(aKey.X));
+            add(uint32_t(aKey.Y));
+            add(uint32_t(aKey.TileSize));
+            add(std::hash<double>()(aKey.LightAzimuth));
+            add(std::hash<double>()(aKey.LightAltitude));
+            add(std::hash<double>()(aKey.Exaggeration));
+            return size_t(h);
+            }
+        };
+
+    /** The heights of a tile's pixels, with a border of one pixel, and the size of a pixel in meters for each row. */
+    class HeightGrid
+        {
+        public:
+        int32_t Size = 0;
+        std::vector<float> Height;
+        std::vector<float> PixelSize;
+        };
+
+    /** A cached item: a height grid or a bitmap. */
+    class Entry
+        {
+        public:
+        std::shared_ptr<const HeightGrid> Grid;
+        std::shared_ptr<const CartoTypeCore::Bitmap> Image;
+        size_t Bytes = 0;
+        Result Error;
+        };
+
+    using EntryList = std::list<std::pair<Key,Entry>>;
+
+    template<class TMaker> std::shared_ptr<const Bitmap> Raster(Result& aError,const Framework& aFramework,const Key& aKey,size_t aThreadCount,TMaker aMaker)
+        {
+        aError = KErrorNone;
+        Entry e;
+        if (Find(aKey,e))
+            return e.Image;
+        auto made = m_flight.Do(aKey,[&]()
+            {
+            Entry entry;
+            Key grid_key { RasterType::HeightGrid, aKey.Zoom, aKey.X, aKey.Y, aKey.TileSize, 0, 0, 0, 0 };
+            Entry grid;
+            if (!Find(grid_key,grid))
+                {
+                grid.Grid = MakeHeightGrid(entry.Error,aFramework,aKey.Zoom,aKey.X,aKey.Y,aKey.TileSize,aThreadCount);
+                if (entry.Error)
+                    return entry;
+                grid.Bytes = grid.Grid->Height.size() * sizeof(float);
+                Insert(grid_key,grid);
+                }
+            entry.Image = std::make_shared<const Bitmap>(aMaker(*grid.Grid));
+            entry.Bytes = size_t(entry.Image->DataBytes());
+            Insert(aKey,entry);
+            return entry;
+            });
+        aError = made->Error;
+        return made->Image;
+        }
+
+    bool Find(const Key& aKey,Entry& aEntry)
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto p = m_map.find(aKey);
+        if (p == m_map.end())
+            return false;
+        m_lru.splice(m_lru.begin(),m_lru,p->second);
+        aEntry = p->second->second;
+        return true;
+        }
+
+    void Insert(const Key& aKey,const Entry& aEntry)
+        {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_map.count(aKey))
+            return;
+        m_lru.emplace_front(aKey,aEntry);
+        m_map[aKey] = m_lru.begin();
+        m_bytes += aEntry.Bytes;
+        while (m_bytes > m_max_bytes && m_lru.size() > 1)
+            {
+            m_bytes -= m_lru.back().second.Bytes;
+            m_map.erase(m_lru.back().first);
+            m_lru.pop_back();
+            }
+        }
+
+    static std::shared_ptr<const HeightGrid> MakeHeightGrid(Result& aError,const Framework& aFramework,int32_t aZoom,int32_t aX,int32_t aY,int32_t aTileSize,
+                                                            size_t aThreadCount)
+        {
+        const double pi = 3.14159265358979323846;
+        auto grid = std::make_shared<HeightGrid>();
+        int32_t n = aTileSize + 2;
+        grid->Size = aTileSize;
+        double tiles = std::ldexp(1.0,aZoom);
+        std::vector<PointFP> point(size_t(n) * n);
+        std::vector<double> latitude(n);
+        for (int32_t j = 0; j < n; j++)
+            {
+            double y = (aY + (j - 0.5) / aTileSize) / tiles;
+            latitude[j] = std::atan(std::sinh(pi * (1 - 2 * y)));
+            for (int32_t i = 0; i < n; i++)
+                point[size_t(j) * n + i] = PointFP((aX + (i - 0.5) / aTileSize) / tiles * 360 - 180,latitude[j] * 180 / pi);
+            }
+        std::vector<int32_t> height = BatchHeights(aError,aFramework,CoordSet(point),CoordType::Degree,aThreadCount);
+        if (aError)
+            return nullptr;
+        // Heights at or below INT16_MIN are taken to be unknown, as in RouteElevationProfile, and drawn as sea level.
+        grid->Height.resize(height.size());
+        for (size_t i = 0; i < height.size(); i++)
+            grid->Height[i] = height[i] <= INT16_MIN ? 0.0f : float(height[i]);
+        grid->PixelSize.resize(n);
+        for (int32_t j = 0; j < n; j++)
+            grid->PixelSize[j] = float(2 * pi * 6378137 * std::cos(latitude[j]) / (tiles * aTileSize));
+        return grid;
+        }
+
+    static Bitmap MakeHillshade(const HeightGrid& aGrid,const TerrainRasterParam& aParam)
+        {
+        const double pi = 3.14159265358979323846;
+        int32_t size = aGrid.Size;
+        int32_t n = size + 2;
+        double azimuth = aParam.LightAzimuth * pi / 180;
+        double altitude = aParam.LightAltitude * pi / 180;
+        // The light vector's components: east, north and up.
+        float lx = float(std::sin(azimuth) * std::cos(altitude));
+        float ly = float(std::cos(azimuth) * std::cos(altitude));
+        float lz = float(std::sin(altitude));
+        float z = float(aParam.Exaggeration);
+
+        Bitmap bitmap(BitmapType::A8,size,size);
+        std::vector<float> shade(size);
+        for (int32_t j = 0; j < size; j++)
+            {
+            const float* above = aGrid.Height.data() + size_t(j) * n;
+            const float* row = above + n;
+            const float* below = row + n;
+            float scale = z / (8 * aGrid.PixelSize[j + 1]);
+            ShadeRow(above,row,below,size,scale,lx,ly,lz,shade.data());
+            uint8_t* dest = bitmap.Data() + size_t(j) * bitmap.RowBytes();
+            for (int32_t i = 0; i < size; i++)
+                dest[i] = uint8_t(shade[i]);
+            }
+        return bitmap;
+        }
+
+    /**
+    Shades a row of aSize pixels using Horn's method, given the rows of heights above, at and below it, each with a border
+    pixel at each end, storing values from 0.5 to 255.5 in aShade. p is the gradient eastwards, q northwards; rows go southwards.
+    */
+    static void ShadeRow(const float* aAbove,const float* aRow,const float* aBelow,int32_t aSize,float aScale,float aLx,float aLy,float aLz,float* aShade)
+        {
+        int32_t i = 0;
+#if defined(CARTOTYPE_HILLSHADE_SSE2)
+        const __m128 two = _mm_set1_ps(2), one = _mm_set1_ps(1), zero = _mm_setzero_ps();
+        const __m128 scale = _mm_set1_ps(aScale), lx = _mm_set1_ps(aLx), ly = _mm_set1_ps(aLy), lz = _mm_set1_ps(aLz);
+        const __m128 k255 = _mm_set1_ps(255), half = _mm_set1_ps(0.5f);
+        for (; i + 4 <= aSize; i += 4)
+            {
+            __m128 a0 = _mm_loadu_ps(aAbove + i), a1 = _mm_loadu_ps(aAbove + i + 1), a2 = _mm_loadu_ps(aAbove + i + 2);
+            __m128 r0 = _mm_loadu_ps(aRow + i), r2 = _mm_loadu_ps(aRow + i + 2);
+            __m128 b0 = _mm_loadu_ps(aBelow + i), b1 = _mm_loadu_ps(aBelow + i + 1), b2 = _mm_loadu_ps(aBelow + i + 2);
+            __m128 p = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(a2,_mm_mul_ps(two,r2)),b2),_mm_add_ps(_mm_add_ps(a0,_mm_mul_ps(two,r0)),b0)),scale);
+            __m128 q = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(a0,_mm_mul_ps(two,a1)),a2),_mm_add_ps(_mm_add_ps(b0,_mm_mul_ps(two,b1)),b2)),scale);
+            __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(one,_mm_mul_ps(p,p)),_mm_mul_ps(q,q)));
+            __m128 s = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(lz,_mm_mul_ps(p,lx)),_mm_mul_ps(q,ly)),d);
+            s = _mm_min_ps(_mm_max_ps(s,zero),one);
+            _mm_storeu_ps(aShade + i,_mm_add_ps(_mm_mul_ps(s,k255),half));
+            }
+#elif defined(CARTOTYPE_HILLSHADE_NEON)
+        const float32x4_t two = vdupq_n_f32(2), one = vdupq_n_f32(1), zero = vdupq_n_f32(0);
+        const float32x4_t scale = vdupq_n_f32(aScale), lx = vdupq_n_f32(aLx), ly = vdupq_n_f32(aLy), lz = vdupq_n_f32(aLz);
+        const float32x4_t k255 = vdupq_n_f32(255), half = vdupq_n_f32(0.5f);
+        for (; i + 4 <= aSize; i += 4)
+            {
+            float32x4_t a0 = vld1q_f32(aAbove + i), a1 = vld1q_f32(aAbove + i + 1), a2 = vld1q_f32(aAbove + i + 2);
+            float32x4_t r0 = vld1q_f32(aRow + i), r2 = vld1q_f32(aRow + i + 2);
+            float32x4_t b0 = vld1q_f32(aBelow + i), b1 = vld1q_f32(aBelow + i + 1), b2 = vld1q_f32(aBelow + i + 2);
+            float32x4_t p = vmulq_f32(vsubq_f32(vaddq_f32(vaddq_f32(a2,vmulq_f32(two,r2)),b2),vaddq_f32(vaddq_f32(a0,vmulq_f32(two,r0)),b0)),scale);
+            float32x4_t q = vmulq_f32(vsubq_f32(vaddq_f32(vaddq_f32(a0,vmulq_f32(two,a1)),a2),vaddq_f32(vaddq_f32(b0,vmulq_f32(two,b1)),b2)),scale);
+            float32x4_t d = vsqrtq_f32(vaddq_f32(vaddq_f32(one,vmulq_f32(p,p)),vmulq_f32(q,q)));
+            float32x4_t s = vdivq_f32(vsubq_f32(vsubq_f32(lz,vmulq_f32(p,lx)),vmulq_f32(q,ly)),d);
+            s = vminq_f32(vmaxq_f32(s,zero),one);
+            vst1q_f32(aShade + i,vaddq_f32(vmulq_f32(s,k255),half));
+            }
+#endif
+        for (; i < aSize; i++)
+            {
+            float p = ((aAbove[i + 2] + 2 * aRow[i + 2] + aBelow[i + 2]) - (aAbove[i] + 2 * aRow[i] + aBelow[i])) * aScale;
+            float q = ((aAbove[i] + 2 * aAbove[i + 1] + aAbove[i + 2]) - (aBelow[i] + 2 * aBelow[i + 1] + aBelow[i + 2])) * aScale;
+            float s = (aLz - p * aLx - q * aLy) / std::sqrt(1 + p * p + q * q);
+            aShade[i] = std::min(std::max(s,0.0f),1.0f) * 255 + 0.5f;
+            }
+        }
+
+    static Bitmap MakeHeightColors(const HeightGrid& aGrid,const TerrainColorRamp& aRamp)
+        {
+        int32_t size = aGrid.Size;
+        int32_t n = size + 2;
+        static const bool layout_ok = CheckRGBA32Layout();
+        assert(layout_ok);
+        (void)layout_ok;
+        Bitmap bitmap(BitmapType::RGBA32,size,size);
+        for (int32_t j = 0; j < size; j++)
+            {
+            const float* row = aGrid.Height.data() + size_t(j + 1) * n + 1;
+            uint8_t* dest = bitmap.Data() + size_t(j) * bitmap.RowBytes();
+            for (int32_t i = 0; i < size; i++)
+                StoreRGBA32(dest + i * 4,aRamp.ColorAt(row[i]));
+            }
+        return bitmap;
+        }
+
+    /** Stores a color, premultiplied by its alpha, in an RGBA32 pixel, whose bytes are in the order A, B, G, R. */
+    static void StoreRGBA32(uint8_t* aPixel,Color aColor)
+        {
+        int32_t a = aColor.Alpha();
+        aPixel[0] = uint8_t(a);
+        aPixel[1] = uint8_t(aColor.Blue() * a / 255);
+        aPixel[2] = uint8_t(aColor.Green() * a / 255);
+        aPixel[3] = uint8_t(aColor.Red() * a / 255);
+        }
+
+    /** Stores a known opaque color using StoreRGBA32 and checks that the library reads the same color back. */
+    static bool CheckRGBA32Layout()
+        {
+        uint8_t pixel[4];
+        Color color(0x12,0x34,0x56,0xFF);
+        StoreRGBA32(pixel,color);
+        BitmapView view(BitmapType::RGBA32,pixel,1,1,4);
+        return view.ColorFunction()(view,0,0) == color;
+        }
+
+    size_t m_max_bytes;
+    mutable std::mutex m_mutex;
+    EntryList m_lru;
+    std::unordered_map<Key,EntryList::iterator,KeyHash> m_map;
+    size_t m_bytes = 0;
+    SingleFlight<Key,Entry,KeyHash> m_flight;
+    };
+
+} // namespace CartoTypeCore
@@ -0,0 +1,468 @@
+/*
+cartotype_tour.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <thread>
+
+namespace CartoTypeCore
+{
+
+/** A time window during which a stop on a tour should be visited. Times are in seconds from the start of the tour. */
+class TourTimeWindow
+    {
+    public:
+    /** The earliest time at which the stop can be served; arriving earlier means waiting. */
+    double Start = 0;
+    /** The latest time at which service at the stop should start; lateness is penalized. */
+    double End = std::numeric_limits<double>::infinity();
+    /** The time in seconds spent at the stop. */
+    double ServiceTime = 0;
+    };
+
+/** Parameters for OptimizeTour and CreateBestTour. */
+class TourParam
+    {
+    public:
+    /** If true, the first point is always the start of the tour. */
+    bool StartFixed = true;
+    /** If true, the last point is always the end of the tour. To make a round trip, add the start point again at the end and set this to true. */
+    bool EndFixed = false;
+    /** If true, the tour minimizes distance rather than time. */
+    bool MinimizeDistance = false;
+    /** The time in seconds allowed for optimization, not including creation of the time and distance matrix. */
+    double TimeBudget = 0.5;
+    /** The number of threads to use; zero means the number of hardware threads. */
+    size_t ThreadCount = 0;
+    /** The seed for the random restarts; the same seed gives the same results, if the time budget is not reached. */
+    uint32_t Seed = 1;
+    /** Optional time windows, one for each point. If this array is empty there are no time windows. */
+    std::vector<TourTimeWindow> TimeWindow;
+    /** The cost added for each second by which a time window is missed. */
+    double LatenessPenalty = 100;
+    };
+
+/** The result of a tour optimization. */
+class TourResult
+    {
+    public:
+    /** The indexes of the points in the order in which they are visited. */
+    std::vector<size_t> Order;
+    /** The cost of the tour: its time or distance, plus lateness penalties. */
+    double Cost = 0;
+    /** The total travel time in seconds. */
+    double Time = 0;
+    /** The total distance in metres. */
+    double Distance = 0;
+    /** The total time in seconds by which time windows were missed. */
+    double Lateness = 0;
+    };
+
+/**
+Creates a time and distance matrix using several threads, each of which uses a copy of aFramework
+with aProfile as its main profile and calculates a band of rows. If aThreadCount is zero the
+number of hardware threads is used.
+*/
+inline TimeAndDistanceMatrix ParallelTimeAndDistanceMatrix(Result& aError,const Framework& aFramework,const RouteProfile& aProfile,
+                                                           const std::vector<PointFP>& aFrom,const std::vector<PointFP>& aTo,CoordType aCoordType,
+                                                           size_t aThreadCount = 0)
+    {
+    aError = KErrorNone;
+    if (!aThreadCount)
+        aThreadCount = std::max(1U,std::thread::hardware_concurrency());
+    aThreadCount = std::max(size_t(1),std::min(aThreadCount,aFrom.size()));
+
+    std::vector<uint32_t> matrix(aFrom.size() * aTo.size() * 2);
+    std::vector<Result> error(aThreadCount);
+    std::vector<std::thread> thread_array;
+    size_t rows_per_thread = (aFrom.size() + aThreadCount - 1) / aThreadCount;
+    for (size_t t = 0; t < aThreadCount; t++)
+        {
+        size_t first = t * rows_per_thread;
+        size_t last = std::min(aFrom.size(),first + rows_per_thread);
+        if (first >= last)
+            break;
+        auto framework = aFramework.Copy(error[t],false,false);
+        if (!error[t])
+            error[t] = framework->SetMainProfile(aProfile);
+        if (error[t])
+            break;
+        thread_array.emplace_back([&,first,last,t,f = std::shared_ptr<Framework>(std::move(framework))]()
+            {
+            std::vector<PointFP> from(aFrom.begin() + first,aFrom.begin() + last);
+            auto band = f->TimeAndDistanceMatrix(error[t],from,aTo,aCoordType);
+            for (size_t i = 0; !error[t] && i < from.size(); i++)
+                for (size_t j = 0; j < aTo.size(); j++)
+                    {
+                    matrix[((first + i) * aTo.size() + j) * 2] = band.Time(i,j);
+                    matrix[((first + i) * aTo.size() + j) * 2 + 1] = band.Distance(i,j);
+                    }
+            });
+        }
+    for (auto& t : thread_array)
+        t.join();
+    for (auto e : error)
+        if (e)
+            {
+            aError = e;
+            return CartoTypeCore::TimeAndDistanceMatrix();
+            }
+    return CartoTypeCore::TimeAndDistanceMatrix(aFrom.size(),aTo.size(),std::move(matrix));
+    }
+
+/**
+A solver for the asymmetric open travelling salesman problem with optional time windows,
+used by OptimizeTour. Each solver runs iterated local search, using 2-opt and Or-opt moves
+and double-bridge perturbations, from its own starting tour until a deadline.
+*/
+class TourSolver
+    {
+    public:
+    /** Creates a solver for the points in aMatrix, which must be square. */
+    TourSolver(const TimeAndDistanceMatrix& aMatrix,const TourParam& aParam):
+        m_matrix(aMatrix),
+        m_param(aParam),
+        m_n(aMatrix.FromCount()),
+        m_lo(aParam.StartFixed ? 1 : 0),
+        m_hi(aParam.EndFixed && m_n > 1 ? m_n - 2 : m_n - 1),
+        m_time_windows(aParam.TimeWindow.size() == aMatrix.FromCount())
+        {
+        }
+
+    /** Returns the cost of travelling from point aFrom to point aTo. */
+    double ArcCost(size_t aFrom,size_t aTo) const
+        {
+        uint32_t c = m_param.MinimizeDistance ? m_matrix.Distance(aFrom,aTo) : m_matrix.Time(aFrom,aTo);
+        return c == UINT32_MAX ? KUnreachableCost : double(c);
+        }
+
+    /** Evaluates a tour, filling in everything in aResult except the order. */
+    void Evaluate(const std::vector<size_t>& aOrder,TourResult& aResult) const
+        {
+        aResult.Time = aResult.Distance = aResult.Lateness = 0;
+        double travel_cost = 0;
+        double clock = 0;
+        for (size_t k = 0; k < aOrder.size(); k++)
+            {
+            if (k)
+                {
+                travel_cost += ArcCost(aOrder[k - 1],aOrder[k]);
+                aResult.Time += m_matrix.Time(aOrder[k - 1],aOrder[k]);
+                aResult.Distance += m_matrix.Distance(aOrder[k - 1],aOrder[k]);
+                clock += m_matrix.Time(aOrder[k - 1],aOrder[k]);
+                }
+            if (m_time_windows)
+                {
+                const TourTimeWindow& w = m_param.TimeWindow[aOrder[k]];
+                if (clock < w.Start)
+                    clock = w.Start;
+                else if (clock > w.End)
+                    aResult.Lateness += clock - w.End;
+                clock += w.ServiceTime;
+                }
+            }
+        if (m_time_windows && !m_param.MinimizeDistance)
+            travel_cost = clock;
+        aResult.Cost = travel_cost + aResult.Lateness * m_param.LatenessPenalty;
+        }
+
+    /** Returns the cost of a tour. */
+    double Cost(const std::vector<size_t>& aOrder) const
+        {
+        TourResult r;
+        Evaluate(aOrder,r);
+        return r.Cost;
+        }
+
+    /** Creates a starting tour by a nearest-neighbour construction, choosing at random among the aChoice nearest if aChoice is greater than 1. */
+    std::vector<size_t> NearestNeighbourTour(std::mt19937& aRandom,size_t aChoice) const
+        {
+        std::vector<size_t> order;
+        std::vector<bool> used(m_n);
+        if (m_param.StartFixed || m_n == 1)
+            {
+            order.push_back(0);
+            used[0] = true;
+            }
+        size_t last_fixed = m_param.EndFixed && m_n > 1 ? m_n - 1 : SIZE_MAX;
+        if (last_fixed != SIZE_MAX)
+            used[last_fixed] = true;
+        std::vector<std::pair<double,size_t>> candidate;
+        while (order.size() + (last_fixed != SIZE_MAX) < m_n)
+            {
+            candidate.clear();
+            for (size_t i = 0; i < m_n; i++)
+                if (!used[i])
+                    candidate.emplace_back(order.empty() ? 0 : ArcCost(order.back(),i),i);
+            size_t k = std::min(aChoice,candidate.size());
+            std::partial_sort(candidate.begin(),candidate.begin() + k,candidate.end());
+            size_t next = candidate[k > 1 ? aRandom() % k : 0].second;
+            order.push_back(next);
+            used[next] = true;
+            }
+        if (last_fixed != SIZE_MAX)
+            order.push_back(last_fixed);
+        return order;
+        }
+
+    /** Improves a tour using 2-opt and Or-opt moves until no move improves it or the deadline is reached. */
+    void LocalSearch(std::vector<size_t>& aOrder,std::chrono::steady_clock::time_point aDeadline) const
+        {
+        bool improved = true;
+        while (improved && std::chrono::steady_clock::now() < aDeadline)
+            improved = TwoOpt(aOrder,aDeadline) | OrOpt(aOrder,aDeadline);
+        }
+
+    /** Runs iterated local search from a starting tour until the deadline and returns the best tour found. */
+    std::vector<size_t> Solve(std::vector<size_t> aOrder,std::mt19937& aRandom,std::chrono::steady_clock::time_point aDeadline) const
+        {
+        LocalSearch(aOrder,aDeadline);
+        std::vector<size_t> best = aOrder;
+        double best_cost = Cost(best);
+        if (m_hi < m_lo + 7)
+            return best;
+        while (std::chrono::steady_clock::now() < aDeadline)
+            {
+            aOrder = best;
+            DoubleBridge(aOrder,aRandom);
+            LocalSearch(aOrder,aDeadline);
+            double cost = Cost(aOrder);
+            if (cost < best_cost)
+                {
+                best_cost = cost;
+                best = aOrder;
+                }
+            }
+        return best;
+        }
+
+    private:
+    static constexpr double KUnreachableCost = 1e9;
+    static constexpr double KEpsilon = 1e-6;
+
+    /** Reverses segments of the tour while that reduces its cost. */
+    bool TwoOpt(std::vector<size_t>& aOrder,std::chrono::steady_clock::time_point aDeadline) const
+        {
+        bool improved = false;
+        std::vector<double> forward(m_n),backward(m_n);
+        bool again = true;
+        while (again && std::chrono::steady_clock::now() < aDeadline)
+            {
+            again = false;
+            if (!m_time_windows)
+                {
+                // Prefix sums of arc costs in both directions give the cost of a reversed segment in constant time.
+                for (size_t k = 1; k < m_n; k++)
+                    {
+                    forward[k] = forward[k - 1] + ArcCost(aOrder[k - 1],aOrder[k]);
+                    backward[k] = backward[k - 1] + ArcCost(aOrder[k],aOrder[k - 1]);
+                    }
+                }
+            double cost = m_time_windows ? Cost(aOrder) : 0;
+            for (size_t i = m_lo; i < m_hi && !again; i++)
+                for (size_t j = i + 1; j <= m_hi; j++)
+                    {
+                    double delta;
+                    if (m_time_windows)
+                        {
+                        std::reverse(aOrder.begin() + i,aOrder.begin() + j + 1);
+                        delta = Cost(aOrder) - cost;
+                        if (delta >= -KEpsilon)
+                            std::reverse(aOrder.begin() + i,aOrder.begin() + j + 1);
+                        }
+                    else
+                        {
+                        delta = (backward[j] - backward[i]) - (forward[j] - forward[i]);
+                        if (i > 0)
+                            delta += ArcCost(aOrder[i - 1],aOrder[j]) - ArcCost(aOrder[i - 1],aOrder[i]);
+                        if (j + 1 < m_n)
+                            delta += ArcCost(aOrder[i],aOrder[j + 1]) - ArcCost(aOrder[j],aOrder[j + 1]);
+                        if (delta < -KEpsilon)
+                            std::reverse(aOrder.begin() + i,aOrder.begin() + j + 1);
+                        }
+                    if (delta < -KEpsilon)
+                        {
+                        improved = again = true;
+                        break;
+                        }
+                    }
+            }
+        return improved;
+        }
+
+    /** Moves segments of one to three points to other places in the tour while that reduces its cost. */
+    bool OrOpt(std::vector<size_t>& aOrder,std::chrono::steady_clock::time_point aDeadline) const
+        {
+        bool improved = false;
+        std::vector<size_t> reduced;
+        std::vector<size_t> candidate;
+        for (size_t length = 1; length <= 3; length++)
+            for (size_t i = m_lo; i + length - 1 <= m_hi && std::chrono::steady_clock::now() < aDeadline; i++)
+                {
+                size_t e = i + length - 1;
+                reduced.assign(aOrder.begin(),aOrder.begin() + i);
+                reduced.insert(reduced.end(),aOrder.begin() + e + 1,aOrder.end());
+                double cost = m_time_windows ? Cost(aOrder) : 0;
+                double removal = 0;
+                if (!m_time_windows)
+                    {
+                    if (i > 0)
+                        removal -= ArcCost(aOrder[i - 1],aOrder[i]);
+                    if (e + 1 < m_n)
+                        removal -= ArcCost(aOrder[e],aOrder[e + 1]);
+                    if (i > 0 && e + 1 < m_n)
+                        removal += ArcCost(aOrder[i - 1],aOrder[e + 1]);
+                    }
+
+                // Insert the segment before reduced[g], or at the end if g == reduced.size().
+                size_t g_lo = m_lo;
+                size_t g_hi = m_param.EndFixed ? reduced.size() - 1 : reduced.size();
+                for (size_t g = g_lo; g <= g_hi; g++)
+                    {
+                    if (g == i)
+                        continue;
+                    double delta;
+                    if (m_time_windows)
+                        {
+                        candidate.assign(reduced.begin(),reduced.begin() + g);
+                        candidate.insert(candidate.end(),aOrder.begin() + i,aOrder.begin() + e + 1);
+                        candidate.insert(candidate.end(),reduced.begin() + g,reduced.end());
+                        delta = Cost(candidate) - cost;
+                        }
+                    else
+                        {
+                        delta = removal;
+                        if (g > 0)
+                            delta += ArcCost(reduced[g - 1],aOrder[i]);
+                        if (g < reduced.size())
+                            delta += ArcCost(aOrder[e],reduced[g]);
+                        if (g > 0 && g < reduced.size())
+                            delta -= ArcCost(reduced[g - 1],reduced[g]);
+                        }
+                    if (delta < -KEpsilon)
+                        {
+                        if (!m_time_windows)
+                            {
+                            candidate.assign(reduced.begin(),reduced.begin() + g);
+                            candidate.insert(candidate.end(),aOrder.begin() + i,aOrder.begin() + e + 1);
+                            candidate.insert(candidate.end(),reduced.begin() + g,reduced.end());
+                            }
+                        aOrder.swap(candidate);
+                        improved = true;
+                        break;
+                        }
+                    }
+                }
+        return improved;
+        }
+
+    /** Perturbs a tour by cutting the movable part into four pieces and reconnecting them in a different order. */
+    void DoubleBridge(std::vector<size_t>& aOrder,std::mt19937& aRandom) const
+        {
+        size_t span = m_hi - m_lo + 1;
+        size_t cut[3];
+        for (size_t& c : cut)
+            c = 1 + aRandom() % (span - 1);
+        std::sort(cut,cut + 3);
+        if (cut[0] == cut[1] || cut[1] == cut[2])
+            return;
+        auto base = aOrder.begin() + m_lo;
+        std::vector<size_t> piece;
+        piece.insert(piece.end(),base,base + cut[0]);
+        piece.insert(piece.end(),base + cut[2],base + span);
+        piece.insert(piece.end(),base + cut[1],base + cut[2]);
+        piece.insert(piece.end(),base + cut[0],base + cut[1]);
+        std::copy(piece.begin(),piece.end(),base);
+        }
+
+    const TimeAndDistanceMatrix& m_matrix;
+    const TourParam& m_param;
+    size_t m_n;
+    size_t m_lo;
+    size_t m_hi;
+    bool m_time_windows;
+    };
+
+/**
+Finds a good order in which to visit a set of points, given a square matrix of times and distances between them.
+Restarts run in parallel, one per thread, until the time budget in aParam is used up, and the best tour is returned.
+*/
+inline TourResult OptimizeTour(const TimeAndDistanceMatrix& aMatrix,const TourParam& aParam)
+    {
+    TourResult result;
+    size_t n = aMatrix.FromCount();
+    if (n != aMatrix.ToCount() || n == 0)
+        return result;
+    TourSolver solver(aMatrix,aParam);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(aParam.TimeBudget));
+
+    size_t thread_count = aParam.ThreadCount ? aParam.ThreadCount : std::max(1U,std::thread::hardware_concurrency());
+    if (n < 8)
+        thread_count = 1;
+    std::vector<std::vector<size_t>> tour(thread_count);
+    std::vector<std::thread> thread_array;
+    for (size_t t = 0; t < thread_count; t++)
+        thread_array.emplace_back([&,t]()
+            {
+            std::mt19937 random(aParam.Seed + uint32_t(t));
+            // The first thread starts from the plain nearest-neighbour tour; the others from randomized ones.
+            tour[t] = solver.Solve(solver.NearestNeighbourTour(random,t ? 3 : 1),random,deadline);
+            });
+    for (auto& t : thread_array)
+        t.join();
+
+    double best_cost = std::numeric_limits<double>::infinity();
+    for (auto& t : tour)
+        {
+        double cost = solver.Cost(t);
+        if (cost < best_cost)
+            {
+            best_cost = cost;
+            result.Order = t;
+            }
+        }
+    solver.Evaluate(result.Order,result);
+    return result;
+    }
+
+/**
+Creates a route visiting all the points in aCoordSet in a good order, like Framework::CreateBestRoute,
+but for large numbers of stops: the time and distance matrix is created in parallel by ParallelTimeAndDistanceMatrix,
+and the order is found by OptimizeTour, which supports time windows. If aTour is non-null the order and
+its cost are returned in it.
+*/
+inline std::unique_ptr<Route> CreateBestTour(Result& aError,Framework& aFramework,const RouteProfile& aProfile,const RouteCoordSet& aCoordSet,
+                                             const TourParam& aParam,TourResult* aTour = nullptr)
+    {
+    std::vector<PointFP> point_array;
+    for (const auto& p : aCoordSet.RoutePointArray)
+        point_array.push_back(p.Point);
+    if (point_array.size() < 2)
+        {
+        aError = KErrorInvalidArgument;
+        return nullptr;
+        }
+    auto matrix = ParallelTimeAndDistanceMatrix(aError,aFramework,aProfile,point_array,point_array,aCoordSet.CoordType,aParam.ThreadCount);
+    if (aError)
+        return nullptr;
+    TourResult tour = OptimizeTour(matrix,aParam);
+
+    RouteCoordSet ordered(aCoordSet.CoordType);
+    for (size_t i : tour.Order)
+        ordered.RoutePointArray.push_back(aCoordSet.RoutePointArray[i]);
+    auto route = aFramework.CreateRoute(aError,aProfile,ordered);
+    if (aTour)
+        *aTour = std::move(tour);
+    return route;
+    }
+
+} // namespace CartoTypeCore
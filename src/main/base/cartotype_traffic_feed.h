@@ -0,0 +1,359 @@
+/*
+cartotype_traffic_feed.h
+Copyright (C) 2024 CartoType Ltd.
+See www.cartotype.com for more information.
+*/
+
+#pragma once
+
+#include <cartotype_framework.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+namespace CartoTypeCore
+{
+
+/**
+Returns a binary key made from the contents of a location reference: its type, orientation, side of road,
+radius and points. Equal references have equal keys, so the key can be used to cache decoded references.
+*/
+inline std::string LocationRefKey(const LocationRef& aLocationRef)
+    {
+    std::string key;
+    auto append = [&key](const void* aData,size_t aSize) { key.append(reinterpret_cast<const char*>(aData),aSize); };
+    int32_t header[5] = { int32_t(aLocationRef.Type), int32_t(aLocationRef.RoadOrientation), int32_t(aLocationRef.SideOfRoad),
+                          int32_t(aLocationRef.Geometry.CoordType()), int32_t(aLocationRef.Geometry.ContourCount()) };
+    append(header,sizeof(header));
+    append(&aLocationRef.RadiusInMeters,sizeof(double));
+    for (size_t i = 0; i < aLocationRef.Geometry.ContourCount(); i++)
+        {
+        uint32_t n = uint32_t(aLocationRef.Geometry.PointCount(i));
+        append(&n,sizeof(n));
+        for (size_t j = 0; j < n; j++)
+            {
+            const OutlinePointFP& p = aLocationRef.Geometry.Point(i,j);
+            append(&p.X,sizeof(double));
+            append(&p.Y,sizeof(double));
+            }
+        }
+    return key;
+    }
+
+/** One item of a traffic feed: a speed for a location. */
+class TrafficFeedItem
+    {
+    public:
+    /** Creates a traffic feed item for a location reference of a given type and coordinate type. */
+    TrafficFeedItem(LocationRefType aType = LocationRefType::Line,CoordType aCoordType = CoordType::Degree):
+        Location(aType,aCoordType)
+        {
+        }
+
+    /**
+    A key identifying the location across successive feeds, such as the feed's segment identifier; the same key must always refer to the same location.
+    If it is empty, a key is made from the location, using LocationRefKey, and the vehicle types, so that identical location references
+    are recognized without decoding them, and items for different vehicle types at the same location are kept apart.
+    */
+    std::string Key;
+    /** The speed and the vehicle types it applies to. */
+    TrafficInfo Info;
+    /** The location. */
+    LocationRef Location;
+    };
+
+/** Statistics returned by TrafficFeed::Apply. */
+class TrafficFeedStatistics
+    {
+    public:
+    /** The number of items added, including changed items. */
+    size_t Added = 0;
+    /** The number of items deleted, including changed items. */
+    size_t Deleted = 0;
+    /** The number of items that were unchanged and needed no work. */
+    size_t Unchanged = 0;
+    /** The number of items whose location could not be decoded. */
+    size_t Failed = 0;
+    /** The number of items ignored because a later item in the same feed had the same key. */
+    size_t Duplicates = 0;
+    };
+
+/**
+Applies complete traffic feeds to a framework, doing work only for the locations whose
+speeds have changed since the previous feed.
+
+A city-wide feed of speeds arriving every minute is mostly the same as the one before it.
+Clearing all traffic information and adding every item again means decoding every location
+reference each time; Apply compares the new feed with the previous one by key and calls
+Framework::DeleteTrafficInfo and Framework::AddTrafficInfo only for items that are new, changed
+or gone. Speeds within a tolerance of the previous speed are treated as unchanged.
+
+The locations that must be decoded are decoded in order of their positions along a Z-order curve,
+so that neighbouring references follow each other and the map data for their candidate lines is
+still in the stream cache.
+*/
+class TrafficFeed
+    {
+    public:
+    /** Creates a traffic feed which updates the traffic information in aFramework. */
+    explicit TrafficFeed(Framework& aFramework): m_framework(aFramework) { }
+
+    /** Sets the tolerance in kph within which a speed is treated as unchanged. The default is 2kph. */
+    void SetSpeedTolerance(double aSpeedTolerance) { m_speed_tolerance = aSpeedTolerance; }
+
+    /**
+    Replaces the previous feed by aFeed. Items are matched with those of the previous feed by their keys.
+    If several items in the feed have the same key, the last one is used and the others are counted as duplicates.
+    Items whose locations cannot be decoded are counted but are not an error; they are not tried again until their speeds change.
+    */
+    Result Apply(std::vector<TrafficFeedItem>& aFeed,TrafficFeedStatistics* aStatistics = nullptr)
+        {
+        TrafficFeedStatistics stats;
+        std::unordered_map<std::string,Entry> new_entry_map;
+        new_entry_map.reserve(aFeed.size());
+
+        std::vector<std::string> key_array(aFeed.size());
+        std::unordered_map<std::string,size_t> last_index;
+        last_index.reserve(aFeed.size());
+        for (size_t i = 0; i < aFeed.size(); i++)
+            {
+            key_array[i] = ItemKey(aFeed[i]);
+            last_index[key_array[i]] = i;
+            }
+
+        std::vector<size_t> decode_array;
+        for (size_t i = 0; i < aFeed.size(); i++)
+            {
+            const TrafficFeedItem& item = aFeed[i];
+            if (last_index.find(key_array[i])->second != i)
+                {
+                stats.Duplicates++;
+                continue;
+                }
+            auto p = m_entry_map.find(key_array[i]);
+            if (p != m_entry_map.end() && Same(p->second,item))
+                {
+                new_entry_map.emplace(key_array[i],p->second);
+                m_entry_map.erase(p);
+                stats.Unchanged++;
+                continue;
+                }
+            if (p != m_entry_map.end())
+                {
+                Result error = Delete(p->second);
+                if (error)
+                    return Restore(new_entry_map,error);
+                m_entry_map.erase(p);
+                stats.Deleted++;
+                }
+            decode_array.push_back(i);
+            }
+
+        SortSpatially(aFeed,decode_array);
+        for (size_t i : decode_array)
+            {
+            TrafficFeedItem& item = aFeed[i];
+            Entry e;
+            e.Speed = item.Info.Speed;
+            e.VehicleTypes = item.Info.VehicleTypes;
+            if (m_framework.AddTrafficInfo(e.Id,item.Info,item.Location))
+                {
+                e.Id = 0;
+                stats.Failed++;
+                }
+            else
+                stats.Added++;
+            // Keys are unique after the duplicates have been removed, but an entry that cannot be stored must not be left in the framework.
+            if (!new_entry_map.emplace(key_array[i],e).second)
+                {
+                Result error = Delete(e);
+                if (error)
+                    return Restore(new_entry_map,error);
+                }
+            }
+
+        // Anything left over was not in the new feed.
+        for (auto p = m_entry_map.begin(); p != m_entry_map.end(); p = m_entry_map.erase(p))
+            {
+            Result error = Delete(p->second);
+            if (error)
+                return Restore(new_entry_map,error);
+            stats.Deleted++;
+            }
+        m_entry_map.swap(new_entry_map);
+        if (aStatistics)
+            *aStatistics = stats;
+        return KErrorNone;
+        }
+
+    /** Deletes all the traffic information added by this object. */
+    Result Clear()
+        {
+        for (auto p = m_entry_map.begin(); p != m_entry_map.end(); p = m_entry_map.erase(p))
+            {
+            Result error = Delete(p->second);
+            if (error)
+                return error;
+            }
+        return KErrorNone;
+        }
+
+    private:
+    class Entry
+        {
+        public:
+        uint64_t Id = 0;
+        double Speed = 0;
+        uint32_t VehicleTypes = 0;
+        };
+
+    /**
+    Returns the key of a feed item. The speed is not part of the default key because it is matched within a tolerance;
+    items differing only in speed are duplicates, and the last one is used.
+    */
+    static std::string ItemKey(const TrafficFeedItem& aItem)
+        {
+        if (!aItem.Key.empty())
+            return aItem.Key;
+        std::string key = LocationRefKey(aItem.Location);
+        key.append(reinterpret_cast<const char*>(&aItem.Info.VehicleTypes),sizeof(aItem.Info.VehicleTypes));
+        return key;
+        }
+
+    bool Same(const Entry& aEntry,const TrafficFeedItem& aItem) const
+        {
+        if (aEntry.VehicleTypes != aItem.Info.VehicleTypes)
+            return false;
+        // Forbidden and unlimited are distinct states, not speeds to be compared within a tolerance.
+        if ((aEntry.Speed <= 0) != (aItem.Info.Speed <= 0) ||
+            (aEntry.Speed >= TrafficInfo::KNoSpeedLimit) != (aItem.Info.Speed >= TrafficInfo::KNoSpeedLimit))
+            return false;
+        return std::fabs(aEntry.Speed - aItem.Info.Speed) <= m_speed_tolerance;
+        }
+
+    /** Sorts the indexes of feed items by the Z-order of the first point of each item's location. */
+    static void SortSpatially(const std::vector<TrafficFeedItem>& aFeed,std::vector<size_t>& aIndex)
+        {
+        RectFP bounds;
+        bool have_bounds = false;
+        for (size_t i : aIndex)
+            if (!aFeed[i].Location.Geometry.IsEmpty())
+                {
+                const OutlinePointFP& p = aFeed[i].Location.Geometry.Point(0,0);
+                if (!have_bounds)
+                    bounds.Min = bounds.Max = p;
+                else
+                    bounds.Combine(p);
+                have_bounds = true;
+                }
+        if (!have_bounds)
+            return;
+        double sx = bounds.Max.X > bounds.Min.X ? 65535 / (bounds.Max.X - bounds.Min.X) : 0;
+        double sy = bounds.Max.Y > bounds.Min.Y ? 65535 / (bounds.Max.Y - bounds.Min.Y) : 0;
+        auto spread = [](uint32_t aValue)
+            {
+            aValue = (aValue | (aValue << 8)) & 0x00FF00FF;
+            aValue = (aValue | (aValue << 4)) & 0x0F0F0F0F;
+            aValue = (aValue | (aValue << 2)) & 0x33333333;
+            aValue = (aValue | (aValue << 1)) & 0x55555555;
+            return aValue;
+            };
+        std::vector<std::pair<uint32_t,size_t>> order;
+        order.reserve(aIndex.size());
+        for (size_t i : aIndex)
+            {
+            uint32_t code = 0;
+            if (!aFeed[i].Location.Geometry.IsEmpty())
+                {
+                const OutlinePointFP& p = aFeed[i].Location.Geometry.Point(0,0);
+                code = spread(uint32_t((p.X - bounds.Min.X) * sx)) | (spread(uint32_t((p.Y - bounds.Min.Y) * sy)) << 1);
+                }
+            order.emplace_back(code,i);
+            }
+        std::sort(order.begin(),order.end());
+        for (size_t i = 0; i < order.size(); i++)
+            aIndex[i] = order[i].second;
+        }
+
+    /** Keeps track of everything added so far if Apply fails part of the way through. */
+    Result Restore(std::unordered_map<std::string,Entry>& aNewEntryMap,Result aError)
+        {
+        m_entry_map.insert(aNewEntryMap.begin(),aNewEntryMap.end());
+        return aError;
+        }
+
+    Result Delete(const Entry& aEntry)
+        {
+        if (!aEntry.Id)
+            return KErrorNone;
+        return m_framework.DeleteTrafficInfo(aEntry.Id);
+        }
+
+    Framework& m_framework;
+    double m_speed_tolerance = 2;
+    std::unordered_map<std::string,Entry> m_entry_map;
+    };
+
+/** A route to be encoded as a line traffic message by WriteLineTrafficMessagesAsXml. */
+class LineTrafficMessage
+    {
+    public:
+    /** The speed and the vehicle types it applies to. */
+    TrafficInfo Info;
+    /** The identifier of the message. */
+    String Id;
+    /** The route: must not be null. */
+    const CartoTypeCore::Route* Route = nullptr;
+    /** True if the route is a closed line. */
+    bool Closed = false;
+    };
+
+/**
+Encodes many line traffic messages as XML, using Framework::WriteLineTrafficMessageAsXml
+or Framework::WriteClosedLineTrafficMessageAsXml. The work is shared between several threads,
+each of which uses a copy of aFramework. If aThreadCount is zero the number of hardware threads is used.
+Returns one XML string for each message; the first error to occur, if any, is returned in aError.
+*/
+inline std::vector<std::string> WriteLineTrafficMessagesAsXml(Result& aError,const Framework& aFramework,const std::vector<LineTrafficMessage>& aMessageArray,size_t aThreadCount = 0)
+    {
+    aError = KErrorNone;
+    std::vector<std::string> xml(aMessageArray.size());
+    if (aMessageArray.empty())
+        return xml;
+    if (!aThreadCount)
+        aThreadCount = std::max(1U,std::thread::hardware_concurrency());
+    aThreadCount = std::max(size_t(1),std::min(aThreadCount,aMessageArray.size()));
+
+    std::vector<Result> error(aThreadCount);
+    std::vector<std::thread> thread_array;
+    for (size_t t = 0; t < aThreadCount; t++)
+        {
+        std::shared_ptr<Framework> framework = aFramework.Copy(error[t],false,false);
+        if (error[t])
+            break;
+        thread_array.emplace_back([&,t,framework]()
+            {
+            for (size_t i = t; i < aMessageArray.size() && !error[t]; i += aThreadCount)
+                {
+                const LineTrafficMessage& m = aMessageArray[i];
+                MemoryOutputStream output;
+                error[t] = m.Closed ? framework->WriteClosedLineTrafficMessageAsXml(output,m.Info,m.Id,*m.Route) :
+                                      framework->WriteLineTrafficMessageAsXml(output,m.Info,m.Id,*m.Route);
+                xml[i].assign(reinterpret_cast<const char*>(output.Data()),output.Length());
+                }
+            });
+        }
+    for (auto& t : thread_array)
+        t.join();
+    for (auto e : error)
+        if (e)
+            {
+            aError = e;
+            break;
+            }
+    return xml;
+    }
+
+} // namespace CartoTypeCore